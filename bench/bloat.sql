@@ -0,0 +1,138 @@
+-- bench/bloat.sql
+--
+-- сравнение раздувания таблицы задач до и после разделения ts.task
+-- на ts.task_def и ts.task_schedule
+--
+-- запуск:
+--   psql -v tasks=10000 -v rounds=20 -f bench/bloat.sql > bench_output.txt
+--
+-- каждый раунд обновляет время следующего выполнения у всех задач, так же,
+-- как это делает worker после выполнения повторяющейся задачи,
+-- раунды идут в отдельных транзакциях, чтобы работала очистка HOT цепочек
+
+\set ON_ERROR_STOP on
+
+\if :{?tasks}
+\else
+\set tasks 10000
+\endif
+
+\if :{?rounds}
+\else
+\set rounds 20
+\endif
+
+DROP SCHEMA IF EXISTS ts_bench CASCADE;
+CREATE SCHEMA ts_bench;
+
+-- раскладка версии 1.0
+CREATE TABLE ts_bench.task_wide (
+    task_id BIGINT PRIMARY KEY,
+    command TEXT NOT NULL,
+    type TEXT NOT NULL,
+    exec_interval INTERVAL,
+    time_next_exec TIMESTAMPTZ NOT NULL,
+    repeat_limit BIGINT,
+    until TIMESTAMPTZ,
+    note TEXT,
+    username TEXT NOT NULL,
+    database TEXT NOT NULL
+);
+
+-- раскладка версии 1.1
+CREATE TABLE ts_bench.task_def (
+    task_id BIGINT PRIMARY KEY,
+    command TEXT NOT NULL,
+    note TEXT,
+    username TEXT NOT NULL,
+    database TEXT NOT NULL
+);
+
+CREATE TABLE ts_bench.task_schedule (
+    task_id BIGINT PRIMARY KEY
+        REFERENCES ts_bench.task_def (task_id) ON DELETE CASCADE,
+    time_next_exec TIMESTAMPTZ NOT NULL,
+    repeat_limit BIGINT,
+    until TIMESTAMPTZ,
+    exec_count BIGINT NOT NULL DEFAULT 0,
+    exec_interval INTERVAL,
+    type TEXT NOT NULL
+) WITH (fillfactor = 70);
+
+-- команды и комментарии типичного размера, чтобы кортеж был "широким"
+INSERT INTO ts_bench.task_wide
+    SELECT i, 'SELECT ' || repeat('x', 400), 'repeat', '1 minute', now(),
+           NULL, NULL, repeat('n', 200), current_user, current_database()
+    FROM generate_series(1, :tasks) AS i;
+
+INSERT INTO ts_bench.task_def
+    SELECT task_id, command, note, username, database FROM ts_bench.task_wide;
+
+INSERT INTO ts_bench.task_schedule
+    (task_id, time_next_exec, exec_interval, type)
+    SELECT task_id, time_next_exec, exec_interval, type
+    FROM ts_bench.task_wide;
+
+VACUUM ANALYZE ts_bench.task_wide, ts_bench.task_def, ts_bench.task_schedule;
+
+CREATE TABLE ts_bench.result (
+    layout TEXT PRIMARY KEY,
+    wal_bytes NUMERIC NOT NULL,
+    scan_ms DOUBLE PRECISION NOT NULL
+);
+
+CREATE PROCEDURE ts_bench.run(layout TEXT, update_sql TEXT, scan_sql TEXT,
+                              rounds INT)
+LANGUAGE plpgsql
+AS $$
+DECLARE
+    lsn_start pg_lsn := pg_current_wal_insert_lsn();
+    scan_start TIMESTAMPTZ;
+    scan_ms DOUBLE PRECISION := 0;
+BEGIN
+    FOR i IN 1..rounds LOOP
+        EXECUTE update_sql;
+        COMMIT;
+
+        scan_start := clock_timestamp();
+        EXECUTE scan_sql;
+        scan_ms := scan_ms + extract(epoch FROM clock_timestamp() - scan_start) * 1000;
+        COMMIT;
+    END LOOP;
+
+    INSERT INTO ts_bench.result VALUES (
+        layout,
+        pg_wal_lsn_diff(pg_current_wal_insert_lsn(), lsn_start),
+        scan_ms / rounds);
+END;
+$$;
+
+CALL ts_bench.run(
+    'wide (1.0)',
+    'UPDATE ts_bench.task_wide SET time_next_exec = time_next_exec + exec_interval',
+    'SELECT count(*) FROM ts_bench.task_wide WHERE time_next_exec <= now()',
+    :rounds);
+
+CALL ts_bench.run(
+    'hot/cold (1.1)',
+    'UPDATE ts_bench.task_schedule SET time_next_exec = time_next_exec + exec_interval, '
+    'exec_count = exec_count + 1',
+    'SELECT count(*) FROM ts_bench.task_schedule WHERE time_next_exec <= now()',
+    :rounds);
+
+SELECT pg_stat_force_next_flush();
+
+SELECT r.layout,
+       pg_size_pretty(r.wal_bytes) AS wal,
+       round(r.scan_ms::NUMERIC, 3) AS scan_ms,
+       pg_size_pretty(pg_total_relation_size(t.relid)) AS total_size,
+       t.n_tup_upd AS updates,
+       t.n_tup_hot_upd AS hot_updates
+FROM ts_bench.result r
+JOIN pg_stat_user_tables t
+    ON t.schemaname = 'ts_bench'
+   AND t.relname = CASE WHEN r.layout LIKE 'wide%' THEN 'task_wide'
+                        ELSE 'task_schedule' END
+ORDER BY r.layout DESC;
+
+DROP SCHEMA ts_bench CASCADE;
@@ -0,0 +1,74 @@
+-- bench/queue_throughput.sql
+--
+-- пропускная способность очереди разовых задач
+--
+-- запуск в базе, к которой подключены воркеры (postgres), на тестовом
+-- сервере с реальным временем планировщика:
+--   psql -d postgres -v jobs=10000 -f bench/queue_throughput.sql > bench_output.txt
+--
+-- в очередь одной транзакцией ставятся jobs задач на текущее время,
+-- затем бенчмарк ждет, пока воркеры их выполнят, и считает, сколько задач
+-- в секунду выполнено; сравнить можно, меняя queue_max_parallel
+-- и max_executors
+
+\set ON_ERROR_STOP on
+
+\if :{?jobs}
+\else
+\set jobs 10000
+\endif
+
+\if :{?timeout}
+\else
+\set timeout 600
+\endif
+
+SELECT current_setting('pg_tkach_scheduler.queue_max_parallel') AS queue_max_parallel,
+       current_setting('pg_tkach_scheduler.max_executors') AS max_executors;
+
+CREATE TEMP TABLE bench_before AS
+    SELECT name, value FROM ts.stats();
+
+SELECT clock_timestamp() AS enqueue_start
+\gset
+
+SELECT count(ts.enqueue('SELECT ' || i, now(), 'queue_throughput bench')) AS enqueued
+FROM generate_series(1, :jobs) AS i;
+
+SELECT clock_timestamp() AS run_start
+\gset
+
+-- ждем, пока все задачи бенчмарка будут отмечены выполненными
+SET bench.timeout = :timeout;
+DO $$
+DECLARE
+    deadline TIMESTAMPTZ :=
+        clock_timestamp() + current_setting('bench.timeout')::INTEGER * INTERVAL '1 second';
+BEGIN
+    WHILE (SELECT count(*) FROM ts.queue q
+           WHERE q.note = 'queue_throughput bench'
+             AND NOT EXISTS (SELECT 1 FROM ts.queue_done d
+                             WHERE d.time_exec = q.time_exec
+                               AND d.job_id = q.job_id)) > 0
+    LOOP
+        IF clock_timestamp() > deadline THEN
+            RAISE WARNING 'queue was not drained in % s',
+                current_setting('bench.timeout');
+            EXIT;
+        END IF;
+        PERFORM pg_sleep(0.05);
+    END LOOP;
+END
+$$;
+
+SELECT round(extract(epoch FROM :'run_start'::TIMESTAMPTZ - :'enqueue_start')::NUMERIC, 3)
+           AS enqueue_s,
+       round(extract(epoch FROM clock_timestamp() - :'run_start')::NUMERIC, 3)
+           AS drain_s,
+       round(:jobs / nullif(extract(epoch FROM clock_timestamp() - :'run_start'), 0)::NUMERIC, 1)
+           AS jobs_per_s;
+
+SELECT a.name, a.value - b.value AS delta
+FROM ts.stats() a JOIN bench_before b USING (name)
+WHERE a.name IN ('queue_jobs', 'tasks_failed', 'ticks')
+ORDER BY a.name;
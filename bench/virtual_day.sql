@@ -0,0 +1,82 @@
+-- bench/virtual_day.sql
+--
+-- прогон суток нагрузки планировщика на виртуальном времени
+--
+-- запуск в базе, к которой подключены воркеры (postgres), на тестовом
+-- сервере: задачи, которые уже есть в ts.task, тоже будут выполнены
+--   psql -d postgres -v tasks=100000 -f bench/virtual_day.sql > bench_output.txt
+--
+-- 95% задач одноразовые и равномерно распределены по суткам, 5% повторяются
+-- каждый час, время двигается шагами по task_check_interval, и каждый шаг
+-- ждет, пока воркеры выполнят задачи, поэтому число выполнений не зависит
+-- от скорости сервера и сравнивается с прогнозом ts.forecast
+
+\set ON_ERROR_STOP on
+
+\if :{?tasks}
+\else
+\set tasks 100000
+\endif
+
+\set day_start '2030-01-01 00:00:00+00'
+
+SELECT ts.set_virtual_time(:'day_start');
+
+-- команды различаются, чтобы воркер не объединял одинаковые задачи
+SET pg_tkach_scheduler.validation = 'parse';
+
+SELECT count(*) AS scheduled
+FROM (
+    SELECT CASE WHEN i % 20 = 0
+        THEN ts.schedule_repeat(
+            'SELECT ' || i,
+            :'day_start'::TIMESTAMPTZ + ((i / 20) % 3599 + 1) * INTERVAL '1 second',
+            '1 hour',
+            'virtual_day bench')
+        ELSE ts.schedule_single(
+            'SELECT ' || i,
+            :'day_start'::TIMESTAMPTZ + ((i - 1)::BIGINT * 86400 / :tasks) * INTERVAL '1 second',
+            'virtual_day bench')
+        END
+    FROM generate_series(1, :tasks) AS i
+) AS s;
+
+CREATE TEMP TABLE bench_expected AS
+    SELECT sum(executions) AS executions
+    FROM ts.forecast(:'day_start', :'day_start'::TIMESTAMPTZ + INTERVAL '1 day', '1 hour');
+
+CREATE TEMP TABLE bench_before AS
+    SELECT name, value FROM ts.stats();
+
+SELECT current_setting('pg_tkach_scheduler.task_check_interval')::INTERVAL AS step,
+       clock_timestamp() AS replay_start
+\gset
+
+SELECT count(ts.advance_time(:'step')) AS steps
+FROM generate_series(1, (extract(epoch FROM INTERVAL '1 day') /
+                         extract(epoch FROM :'step'::INTERVAL))::INT);
+
+SELECT round(extract(epoch FROM clock_timestamp() - :'replay_start')::NUMERIC, 3)
+    AS replay_s;
+
+SELECT e.executions AS forecast_executions,
+       a.value - b.value AS dispatched
+FROM bench_expected e,
+     ts.stats() a JOIN bench_before b USING (name)
+WHERE a.name = 'tasks_executed';
+
+SELECT max(CASE WHEN a.name = 'ticks' THEN a.value - b.value END) AS ticks,
+       round(max(CASE WHEN a.name = 'tick_us' THEN a.value - b.value END)::NUMERIC /
+             nullif(max(CASE WHEN a.name = 'ticks' THEN a.value - b.value END), 0), 1)
+           AS avg_tick_us
+FROM ts.stats() a JOIN bench_before b USING (name);
+
+SELECT a.name, a.value - b.value AS delta
+FROM ts.stats() a JOIN bench_before b USING (name)
+WHERE a.name IN ('tasks_rate_limited', 'tasks_admission_deferred',
+                 'tasks_coalesced', 'tasks_invalid')
+ORDER BY a.name;
+
+DELETE FROM ts.task_def WHERE note = 'virtual_day bench';
+
+SELECT ts.set_virtual_time(NULL);
@@ -7,9 +7,22 @@
 #include "miscadmin.h"
 #include "fmgr.h"
 
+/*
+ * режимы проверки SQL запроса при планировании задачи
+ */
+typedef enum {
+    TS_VALIDATION_FULL,     // полный разбор и планирование
+    TS_VALIDATION_PARSE,    // только синтаксис
+    TS_VALIDATION_DEFERRED, // проверка в воркере перед первым выполнением
+} TSValidationMode;
+
+extern int validation_mode;
+
 Datum ts_schedule(PG_FUNCTION_ARGS);
 Datum ts_unschedule(PG_FUNCTION_ARGS);
 
 static bool isValidQuery(const char *);
+static bool isValidQuerySyntax(const char *);
+static bool isValidQueryPlan(const char *);
 
 #endif
\ No newline at end of file
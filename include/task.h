@@ -17,6 +17,7 @@ typedef enum {
 	Repeat, 	 // задача, которая будет повторяться бесконечно
 	RepeatLimit, // задача, которая будет выполняться ограниченное число раз
 	RepeatUntil, // задача, которая будет выполняться, пока не наступит определенное время
+	Batch,       // задача, которая выполняется пачками, пока обрабатывает строки
 } TaskType;
 
 
@@ -27,6 +28,7 @@ typedef struct Task
 {
     int64 task_id;
     const char *command;
+    uint32 command_hash;    // хеш команды, по нему объединяются одинаковые задачи
     TaskType type;
     Interval *exec_interval;
     TimestampTz time_next_exec;
@@ -35,6 +37,27 @@ typedef struct Task
     const char *note;
     const char *username;
     const char *database;
+    const char *rate_group; // группа ограничения частоты, может быть NULL
+    double rate;            // токенов в секунду для rate_group
+    double burst;           // максимальный запас токенов для rate_group
+    const char *idempotency_key; // ключ, по которому задача не дублируется
+    Oid func;               // функция задачи в режиме вызова, иначе InvalidOid
+    int nargs;              // число аргументов func
+    char **args;            // аргументы func в текстовом виде, NULL - NULL
+    int nsettings;          // число настроек задачи
+    char **settings;        // настройки задачи вида name=value
+    Oid fanout_parent;      // секционированная таблица для fan-out задачи
+    int nfanout_targets;    // число явно заданных целей fan-out задачи
+    char **fanout_targets;  // цели, подставляемые в команду вместо {target}
+    bool deferrable;        // можно откладывать, пока сервер перегружен
+    bool queue_job;         // разовая задача из очереди ts.queue
+    bool validated;         // запрос задачи уже проверен
+    bool deferred;          // задача отложена и в этот раз не выполнялась
+    TimestampTz time_retry; // когда выбрать отложенную задачу снова, 0 - как обычно
+    bool batch_done;        // задача batch обработала все строки
+    bool failed;            // последнее выполнение завершилось ошибкой
+    double exec_time;       // длительность последнего выполнения, мс
+    uint64 wal_bytes;       // WAL, записанный последним выполнением
 
 } Task;
 
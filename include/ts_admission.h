@@ -0,0 +1,18 @@
+/* include/ts_admission.h */
+
+#ifndef TS_ADMISSION
+#define TS_ADMISSION
+
+#include "postgres.h"
+
+#include "ts_shmem.h"
+
+extern int admission_max_active_backends;
+extern int admission_max_lock_waits;
+extern bool admission_defer_on_checkpoint;
+extern int admission_max_replication_lag;
+extern int admission_max_delay;
+
+bool TSAdmissionCheck(TSStats *);
+
+#endif // TS_ADMISSION
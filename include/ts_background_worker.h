@@ -3,20 +3,73 @@
 #ifndef TS_BACKGROUND_WORKER
 #define TS_BACKGROUND_WORKER
 
+#include <sys/resource.h>
+
+#include "access/xact.h"
+#include "executor/instrument.h"
+#include "utils/array.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
 
 extern int task_check_interval;
+extern int task_check_interval_ms;
+extern int num_shards;
+extern int batch_chunk_pause;
+extern int batch_max_chunks_per_tick;
+extern int batch_max_wal_rate;
+extern int batch_retry_delay;
+extern bool coalesce_tasks;
+extern bool adaptive_tick;
+extern int min_check_interval;
+extern int tick_time_budget;
+
+// пределы размера выборки задач в адаптивном режиме
+#define TS_MIN_BATCH 10
+#define TS_MAX_TASK_BATCH 100000
+
+// вес нового замера в сглаженной стоимости задачи
+#define TS_COST_EWMA_ALPHA 0.2
 
 void TSMain(Datum);
-static void ExecuteAllTask(List *);
-static void ExecuteTask(Task *);
-static void UpdateTaskStatus(List *);
-static List *GetCurrentTaskList(TimestampTz);
+static void CountTransaction(XactEvent, void *);
+static void WriteSnapshot(TimestampTz, bool);
+static void ExecuteAllTask(List *, TimestampTz, bool);
+static Task *FindExecutedTask(HTAB *, Task *);
+static bool SameTaskSettings(Task *, Task *);
+static bool ValidateTaskCommand(Task *);
+static bool ValidateTaskCommandAsOwner(Task *);
+static double TimevalDiffMs(const struct timeval *, const struct timeval *);
+static void ExecuteBatchTask(Task *);
+static void UpdateBatchProgress(int64, uint64, double);
+static void UpdateBatchFailure(int64, TimestampTz);
+static int BatchSizeForBudget(double, int);
+static void UpdateCostEwma(double *, int64, int64);
+static TimestampTz GetNextDueTime(TimestampTz, TimestampTz);
+static TimestampTz AdaptiveTickDeadline(TimestampTz, bool);
+static TimestampTz NextTickDeadline(TimestampTz);
+static int64 TaskCheckInterval(void);
+static TimestampTz WaitForTick(TimestampTz);
+static void WorkerSleep(long);
+static void UpdateTaskStatus(List *, TimestampTz);
+static void UpdateTaskRetry(List *);
+static TimestampTz GetNextFutureTimeExec(Task *, TimestampTz);
+static uint64 RunTopLevelStatement(const char *);
+static void ExecuteTopLevelUtility(const char *);
+static bool IsCallCommand(const char *);
+static char *ShardIndexName(void);
+static char *ShardIndexDef(void);
+static void EnsureShardIndex(void);
+static void ReportTaskUsage(Task *, const BufferUsage *, const WalUsage *,
+                            const struct rusage *);
+static List *GetCurrentTaskList(TimestampTz, int, ArrayType *);
 static Task *GetTaskRecordFromTuple(SPITupleTable *, int);
-static void UpdateTaskTimeNextExec(int64, TimestampTz);
-static void UpdateRepeatLimitTask(Task*);
+static void UpdateTaskTimeNextExec(int64, TimestampTz, double, bool);
+static void UpdateRepeatLimitTask(Task*, TimestampTz);
 static void freeTaskList(List*);
 
+extern char *ShardExpression(const char *);
+extern uint64 ExecuteTask(Task *);
+extern bool ExecuteTaskInWorker(Task *, uint64 *);
 extern int64 ScheduleTask(Task*);
 extern bool DeleteTask(int64);
 
@@ -0,0 +1,17 @@
+/* include/ts_call.h */
+
+#ifndef TS_CALL
+#define TS_CALL
+
+#include "postgres.h"
+#include "utils/array.h"
+
+#include "task.h"
+
+char *TSCallCommand(Oid, char **, int, TaskType);
+void TSCallArgsFromArray(ArrayType *, char ***, int *);
+ArrayType *TSCallArgsToArray(char **, int);
+bool TSCallIsProcedure(Task *);
+bool TSCallExecute(Task *, uint64 *);
+
+#endif // TS_CALL
@@ -0,0 +1,19 @@
+/* include/ts_clock.h */
+
+#ifndef TS_CLOCK
+#define TS_CLOCK
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "datatype/timestamp.h"
+
+TimestampTz TSNow(void);
+bool TSClockIsVirtual(void);
+void TSClockRegisterWorker(int);
+void TSClockReportSeen(int, TimestampTz);
+
+Datum ts_now(PG_FUNCTION_ARGS);
+Datum ts_set_virtual_time(PG_FUNCTION_ARGS);
+Datum ts_advance_time(PG_FUNCTION_ARGS);
+
+#endif // TS_CLOCK
@@ -0,0 +1,102 @@
+/* include/ts_executor.h */
+
+#ifndef TS_EXECUTOR
+#define TS_EXECUTOR
+
+#include "postgres.h"
+#include "storage/dsm.h"
+#include "storage/latch.h"
+
+#include "task.h"
+
+// сколько символов сообщения об ошибке задачи передается воркеру
+#define TS_EXECUTOR_ERROR_LEN 256
+
+
+/*
+ * состояние исполнителя в пуле
+ */
+typedef enum
+{
+    TS_EXECUTOR_FREE,     // слот свободен
+    TS_EXECUTOR_STARTING, // процесс запускается и подключается к базе
+    TS_EXECUTOR_IDLE,     // ждет задачу
+    TS_EXECUTOR_BUSY,     // выполняет задачу
+    TS_EXECUTOR_STOPPING, // должен завершиться
+} TSExecutorState;
+
+
+/*
+ * слот исполнителя в общей памяти
+ * исполнитель подключен к базе database от имени username и выполняет
+ * задачи только этой пары, слоты защищены tsShared->lock
+ */
+typedef struct TSExecutorSlot
+{
+    TSExecutorState state;
+    uint64 generation; // номер запуска, чтобы не спутать с новым процессом
+    char username[NAMEDATALEN];
+    char database[NAMEDATALEN];
+    pid_t pid;
+    Latch *latch;       // латч исполнителя
+    Latch *owner_latch; // латч воркера, который ждет исполнителя
+    dsm_handle job;     // задача, DSM_HANDLE_INVALID - нет задачи
+    bool job_done;
+    TimestampTz last_used;
+} TSExecutorSlot;
+
+
+/*
+ * задача, переданная исполнителю, и результат её выполнения
+ * лежит в отдельном сегменте DSM, так как команда может быть любой длины
+ */
+typedef struct TSExecutorJob
+{
+    int64 task_id;
+    Oid func;
+    int nargs;
+    int nsettings;
+    bool queue_job;
+    bool validate; // только проверить запрос, не выполняя его
+
+    // результат
+    bool ok;
+    uint64 processed;
+    uint64 wal_bytes;
+    char error[TS_EXECUTOR_ERROR_LEN];
+
+    // команда, затем nargs аргументов: байт 'n' для NULL или 'v' и строка,
+    // затем nsettings настроек задачи
+    char data[FLEXIBLE_ARRAY_MEMBER];
+} TSExecutorJob;
+
+
+/*
+ * исполнитель, занятый воркером под одну задачу
+ */
+typedef struct TSExecutor
+{
+    int slot;
+    uint64 generation;
+    dsm_segment *segment;
+    TSExecutorJob *job;
+} TSExecutor;
+
+extern int max_executors;
+extern int executor_idle_timeout;
+
+Size TSExecutorShmemSize(void);
+void TSExecutorShmemInit(void);
+
+TSExecutor *TSExecutorAcquire(const char *, const char *);
+TSExecutor *TSExecutorTryAcquire(const char *, const char *);
+void TSExecutorStart(TSExecutor *, Task *);
+bool TSExecutorIsDone(TSExecutor *);
+bool TSExecutorFinish(TSExecutor *, uint64 *, uint64 *);
+bool TSExecutorRun(Task *, uint64 *);
+bool TSExecutorValidate(Task *, bool *);
+void TSExecutorRunAll(Task *, int, int, bool *);
+
+void TSExecutorMain(Datum);
+
+#endif // TS_EXECUTOR
@@ -0,0 +1,24 @@
+/* include/ts_fanout.h */
+
+#ifndef TS_FANOUT
+#define TS_FANOUT
+
+#include "postgres.h"
+
+#include "task.h"
+#include "ts_shmem.h"
+
+// место в команде fan-out задачи, куда подставляется цель
+#define TS_FANOUT_PLACEHOLDER "{target}"
+
+// задача выполняется по частям для каждой цели
+#define TSFanoutTask(task) \
+    (OidIsValid((task)->fanout_parent) || (task)->fanout_targets != NULL)
+
+extern int fanout_max_parallel;
+
+char *TSFanoutCommand(const char *, const char *);
+void TSFanoutCheck(Task *);
+bool TSFanoutRun(Task *, TSStats *);
+
+#endif // TS_FANOUT
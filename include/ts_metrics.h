@@ -0,0 +1,17 @@
+/* include/ts_metrics.h */
+
+#ifndef TS_METRICS
+#define TS_METRICS
+
+#include "postgres.h"
+#include "fmgr.h"
+
+// файл метрик в каталоге данных
+#define TS_METRICS_FILE "pg_tkach_scheduler.prom"
+
+extern int metrics_file_interval;
+
+void TSMetricsWriteFile(void);
+Datum ts_metrics_text(PG_FUNCTION_ARGS);
+
+#endif // TS_METRICS
@@ -0,0 +1,23 @@
+/* include/ts_queue.h */
+
+#ifndef TS_QUEUE
+#define TS_QUEUE
+
+#include "postgres.h"
+#include "datatype/timestamp.h"
+
+#include "ts_shmem.h"
+
+extern int queue_batch_size;
+extern int queue_lookback;
+extern int queue_retention;
+extern int queue_partitions_ahead;
+extern int queue_max_parallel;
+extern bool queue_single;
+
+bool TSQueueProcess(TimestampTz, int, int, TSStats *);
+void TSQueueMaintain(TimestampTz);
+TimestampTz TSQueueWatermark(void);
+void TSQueueRestoreWatermark(int, TimestampTz);
+
+#endif // TS_QUEUE
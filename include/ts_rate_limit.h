@@ -0,0 +1,15 @@
+/* include/ts_rate_limit.h */
+
+#ifndef TS_RATE_LIMIT
+#define TS_RATE_LIMIT
+
+#include "postgres.h"
+#include "datatype/timestamp.h"
+
+bool TSRateLimitAcquire(const char *,
+                        double,
+                        double,
+                        TimestampTz,
+                        TimestampTz *);
+
+#endif // TS_RATE_LIMIT
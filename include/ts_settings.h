@@ -0,0 +1,13 @@
+/* include/ts_settings.h */
+
+#ifndef TS_SETTINGS
+#define TS_SETTINGS
+
+#include "postgres.h"
+
+extern char *task_settings_allowlist;
+
+void TSSettingsCheck(char **, int);
+void TSSettingsApply(char **, int);
+
+#endif // TS_SETTINGS
@@ -0,0 +1,139 @@
+/* include/ts_shmem.h */
+
+#ifndef TS_SHMEM
+#define TS_SHMEM
+
+#include "postgres.h"
+#include "datatype/timestamp.h"
+#include "port/atomics.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+
+
+/*
+ * состояние token bucket одной группы ограничения частоты
+ */
+typedef struct TSRateBucket
+{
+    bool in_use;
+    char group_name[NAMEDATALEN];
+    double tokens;           // сколько токенов доступно сейчас
+    TimestampTz last_refill; // когда токены пополнялись последний раз
+    double rate;             // параметры группы при последнем обращении,
+    double burst;            // по ним видно, что bucket снова полон
+} TSRateBucket;
+
+
+// границы корзин гистограмм, мс
+#define TS_HISTOGRAM_BUCKETS 12
+#define TS_HISTOGRAM_BOUNDS                                              \
+    {                                                                    \
+        1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000         \
+    }
+
+
+/*
+ * гистограмма длительностей
+ * buckets[i] - сколько значений не больше i-й границы и больше предыдущей,
+ * значения больше последней границы учитываются только в count
+ */
+typedef struct TSHistogram
+{
+    int64 buckets[TS_HISTOGRAM_BUCKETS];
+    int64 count;
+    double sum_ms;
+} TSHistogram;
+
+
+/*
+ * статистика воркеров, её показывает ts.stats()
+ * счётчики накапливаются, а сигналы нагрузки хранятся отдельно для
+ * каждого воркера, в shard_stats
+ */
+typedef struct TSStats
+{
+    // счётчики
+    int64 ticks;                    // итераций главного цикла
+    int64 tasks_executed;           // выполненных задач
+    int64 tasks_rate_limited;       // отложено группами ограничения частоты
+    int64 tasks_admission_deferred; // отложено контролем нагрузки
+    int64 overloaded_ticks;         // итераций, когда сервер был перегружен
+    int64 batch_chunks;             // выполненных пачек задач batch
+    int64 tasks_coalesced;          // не выполнено, так как такая же задача
+                                    // уже выполнилась на этой итерации
+    int64 tasks_invalid;            // не прошло отложенную проверку запроса
+    int64 tasks_failed;             // завершилось ошибкой в исполнителе
+    int64 queue_jobs;               // выполненных задач очереди
+    int64 fanout_targets;           // выполненных частей fan-out задач
+    int64 transactions;             // транзакций воркеров и исполнителей
+    int64 tick_us;                  // сколько заняли итерации, мкс
+
+    // сигналы нагрузки, последние значения
+    int64 active_backends;
+    int64 lock_waits;
+    int64 checkpoint_in_progress;
+    int64 replication_lag; // в байтах
+    int64 admission_check_us; // сколько занял последний замер нагрузки
+    int64 tick_lag_us; // насколько позже назначенного началась итерация
+    int64 tick_interval_ms; // выбранная пауза до следующей итерации
+    int64 batch_size;       // выбранный размер выборки задач
+    int64 queue_batch_size; // выбранный размер выборки очереди
+    int64 due_tasks;        // задач, выбранных последней итерацией
+    int64 due_queue_jobs;   // задач очереди, выбранных последней итерацией
+
+    // гистограммы
+    TSHistogram dispatch_lag;  // на сколько позже своего времени запущена задача
+    TSHistogram exec_duration; // сколько выполнялась задача
+    TSHistogram tick_duration; // сколько заняла итерация
+} TSStats;
+
+
+// максимальное число воркеров, pg_tkach_scheduler.num_shards
+#define TS_MAX_SHARDS 64
+
+
+/*
+ * часы планировщика
+ * в режиме виртуального времени воркеры используют virtual_now вместо
+ * текущего времени, его двигают ts.set_virtual_time() и ts.advance_time()
+ */
+typedef struct TSClock
+{
+    bool is_virtual;
+    TimestampTz virtual_now;
+
+    // латчи воркеров, чтобы разбудить их после сдвига времени
+    Latch *worker_latch[TS_MAX_SHARDS];
+    // до какого времени воркер обработал задачи и ждет следующей итерации
+    TimestampTz worker_seen[TS_MAX_SHARDS];
+} TSClock;
+
+
+/*
+ * общее для всех воркеров и бэкендов состояние планировщика
+ */
+typedef struct TSSharedState
+{
+    LWLock *lock;
+
+    TSStats stats;
+    TSClock clock;
+
+    // последняя итерация каждого воркера, из неё берутся сигналы нагрузки
+    TSStats shard_stats[TS_MAX_SHARDS];
+    // транзакции исполнителей, ещё не перенесенные в stats.transactions
+    pg_atomic_uint64 executor_transactions;
+    // до какого времени очередь выбрана каждым воркером, секции
+    // очереди обслуживаются по самому раннему из них
+    TimestampTz queue_watermark[TS_MAX_SHARDS];
+
+    int num_rate_buckets;
+    TSRateBucket rate_buckets[FLEXIBLE_ARRAY_MEMBER];
+} TSSharedState;
+
+extern int max_rate_groups;
+extern TSSharedState *tsShared;
+
+void TSShmemInit(void);
+
+#endif // TS_SHMEM
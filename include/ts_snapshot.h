@@ -0,0 +1,30 @@
+/* include/ts_snapshot.h */
+
+#ifndef TS_SNAPSHOT
+#define TS_SNAPSHOT
+
+#include "postgres.h"
+#include "datatype/timestamp.h"
+#include "utils/array.h"
+
+// сколько ближайших задач воркера сохраняется в снимке
+#define TS_SNAPSHOT_MAX_TASKS 100000
+
+
+/*
+ * состояние воркера, которое переживает его перезапуск
+ */
+typedef struct TSWorkerState
+{
+    double task_cost;            // сглаженная стоимость задачи, мкс
+    double job_cost;             // сглаженная стоимость задачи очереди, мкс
+    TimestampTz queue_watermark; // до какого времени очередь уже выбрана
+} TSWorkerState;
+
+extern int snapshot_interval;
+
+void TSSnapshotWrite(int, const TSWorkerState *, TimestampTz, bool);
+ArrayType *TSSnapshotLoad(int, TSWorkerState *);
+void TSSnapshotRestoreShared(void);
+
+#endif // TS_SNAPSHOT
@@ -0,0 +1,16 @@
+/* include/ts_stats.h */
+
+#ifndef TS_STATS
+#define TS_STATS
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "ts_shmem.h"
+
+void TSStatsReport(int, const TSStats *);
+void TSStatsRead(TSStats *, TSStats *);
+void TSHistogramObserve(TSHistogram *, double);
+Datum ts_stats(PG_FUNCTION_ARGS);
+
+#endif // TS_STATS
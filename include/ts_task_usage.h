@@ -0,0 +1,61 @@
+/* include/ts_task_usage.h */
+
+#ifndef TS_TASK_USAGE
+#define TS_TASK_USAGE
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "executor/instrument.h"
+#include "storage/lwlock.h"
+
+
+#define TS_TASK_USAGE_TRANCHE "pg_tkach_scheduler task usage"
+
+// до скольких доходит счетчик обращений для вытеснения часами
+#define TS_TASK_USAGE_MAX_COUNT 5
+
+
+/*
+ * ресурсы, потраченные на выполнения одной задачи
+ */
+typedef struct TSTaskUsage
+{
+    int64 task_id;
+    int usage_count; // уменьшается стрелкой часов, 0 - можно вытеснить
+    int64 calls;
+    int64 shared_blks_hit;
+    int64 shared_blks_read;
+    int64 shared_blks_dirtied;
+    int64 shared_blks_written;
+    int64 wal_records;
+    int64 wal_fpi;
+    uint64 wal_bytes;
+    double user_time;   // процессорное время, мс
+    double system_time; // мс
+} TSTaskUsage;
+
+
+/*
+ * ресурсы задач в общей памяти: слоты и стрелка часов для вытеснения
+ * защищены своей блокировкой, чтобы учет не ждал tsShared->lock
+ */
+typedef struct TSTaskUsageState
+{
+    LWLock *lock;
+    int num_used;   // занятые слоты, остальные еще ни разу не использовались
+    int clock_hand; // следующий слот, проверяемый при вытеснении
+    TSTaskUsage entries[FLEXIBLE_ARRAY_MEMBER];
+} TSTaskUsageState;
+
+extern int max_tracked_tasks;
+
+Size TSTaskUsageShmemSize(void);
+void TSTaskUsageShmemInit(void);
+void TSTaskUsageReport(int64,
+                       const BufferUsage *,
+                       const WalUsage *,
+                       double,
+                       double);
+Datum ts_task_usage(PG_FUNCTION_ARGS);
+
+#endif // TS_TASK_USAGE
@@ -0,0 +1,501 @@
+/* pg_tkach_scheduler--1.0--1.1.sql */
+
+\echo Use "ALTER EXTENSION pg_tkach_scheduler UPDATE TO '1.1'" to load this file. \quit
+
+-- задачи, которые выполняются пачками
+ALTER TYPE ts.TASK_TYPE ADD VALUE 'batch';
+
+-- разделение ts.task на "холодные" определения и "горячее" расписание
+
+CREATE TABLE ts.rate_limit (
+    group_name TEXT PRIMARY KEY
+        CHECK (pg_catalog.octet_length(group_name) < 64),
+    tokens_per_second DOUBLE PRECISION NOT NULL CHECK (tokens_per_second > 0),
+    burst DOUBLE PRECISION NOT NULL CHECK (burst >= 1)
+);
+
+CREATE TABLE ts.task_def (
+    task_id BIGINT PRIMARY KEY DEFAULT pg_catalog.nextval('ts.task_id_seq'),
+    command TEXT NOT NULL,
+    note TEXT,
+    username TEXT NOT NULL DEFAULT current_user,
+    database TEXT NOT NULL DEFAULT pg_catalog.current_database(),
+    rate_group TEXT REFERENCES ts.rate_limit (group_name)
+        ON UPDATE CASCADE ON DELETE SET NULL,
+    idempotency_key TEXT,
+    valid BOOLEAN DEFAULT true,
+    func REGPROCEDURE,
+    args TEXT[],
+    settings TEXT[],
+    fanout_parent REGCLASS,
+    fanout_targets TEXT[]
+);
+
+CREATE UNIQUE INDEX task_def_idempotency_key_idx
+    ON ts.task_def (idempotency_key) WHERE idempotency_key IS NOT NULL;
+
+CREATE TABLE ts.task_schedule (
+    task_id BIGINT PRIMARY KEY
+        REFERENCES ts.task_def (task_id) ON DELETE CASCADE,
+    time_next_exec TIMESTAMPTZ NOT NULL,
+    repeat_limit BIGINT,
+    until TIMESTAMPTZ,
+    exec_count BIGINT NOT NULL DEFAULT 0,
+    exec_time_total DOUBLE PRECISION NOT NULL DEFAULT 0,
+    rows_processed BIGINT NOT NULL DEFAULT 0,
+    exec_interval INTERVAL,
+    type ts.TASK_TYPE NOT NULL,
+    deferrable BOOLEAN NOT NULL DEFAULT false,
+    last_run_ok BOOLEAN,
+    time_retry TIMESTAMPTZ
+) WITH (fillfactor = 70);
+
+-- переносим существующие задачи
+INSERT INTO ts.task_def (task_id, command, note, username, database)
+    SELECT task_id, command, note, username, database FROM ts.task;
+
+INSERT INTO ts.task_schedule
+    (task_id, time_next_exec, repeat_limit, until, exec_interval, type)
+    SELECT task_id, time_next_exec, repeat_limit, until, exec_interval, type
+    FROM ts.task;
+
+DROP TABLE ts.task;
+
+-- индекс выборки наступивших задач для числа воркеров, заданного при
+-- установке (pg_tkach_scheduler.num_shards); выражение должно совпадать с
+-- ShardExpression в воркере, а определение - с ShardIndexDef
+-- с одним шардом индекс только по time_next_exec
+-- time_next_exec меняется при каждом выполнении, поэтому такие обновления
+-- не HOT: это плата за то, что воркер не просматривает всё расписание
+DO $$
+DECLARE
+    shards INTEGER := coalesce(
+        pg_catalog.current_setting('pg_tkach_scheduler.num_shards', true),
+        '1')::INTEGER;
+BEGIN
+    IF shards > 1 THEN
+        EXECUTE pg_catalog.format(
+            'CREATE INDEX task_schedule_shard_%s_time_idx ON ts.task_schedule '
+            '(((hashint8(task_id) & 2147483647) %% %s), time_next_exec)',
+            shards, shards);
+    ELSE
+        CREATE INDEX task_schedule_shard_1_time_idx
+            ON ts.task_schedule (time_next_exec);
+    END IF;
+END;
+$$;
+
+CREATE VIEW ts.task AS
+    SELECT s.task_id, d.command, s.type, s.exec_interval, s.time_next_exec,
+           s.repeat_limit, s.until, d.note, d.username, d.database,
+           s.exec_count, s.exec_time_total, s.rows_processed, d.rate_group,
+           s.deferrable, d.idempotency_key, d.valid, d.func, d.args,
+           d.settings, d.fanout_parent, d.fanout_targets, s.last_run_ok
+    FROM ts.task_schedule s
+    JOIN ts.task_def d USING (task_id);
+
+-- у ts.schedule появились параметры rate_group, deferrable, idempotency_key,
+-- func, args, settings, fanout_parent и fanout_targets
+DROP FUNCTION ts.schedule(ts.TASK_TYPE,TEXT,TIMESTAMPTZ,INTERVAL,BIGINT,TIMESTAMPTZ,TEXT);
+
+CREATE FUNCTION ts.schedule(
+    type ts.TASK_TYPE,
+    command TEXT,
+    time_next_exec TIMESTAMPTZ,
+    exec_interval INTERVAL DEFAULT NULL,
+    repeat_limit BIGINT DEFAULT NULL,
+    until TIMESTAMPTZ DEFAULT NULL,
+    note TEXT DEFAULT NULL,
+    rate_group TEXT DEFAULT NULL,
+    deferrable BOOLEAN DEFAULT false,
+    idempotency_key TEXT DEFAULT NULL,
+    func REGPROCEDURE DEFAULT NULL,
+    args TEXT[] DEFAULT NULL,
+    settings TEXT[] DEFAULT NULL,
+    fanout_parent REGCLASS DEFAULT NULL,
+    fanout_targets TEXT[] DEFAULT NULL
+)
+RETURNS BIGINT
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'ts_schedule';
+COMMENT ON FUNCTION ts.schedule(ts.TASK_TYPE,TEXT,TIMESTAMPTZ,INTERVAL,BIGINT,TIMESTAMPTZ,TEXT,TEXT,BOOLEAN,TEXT,REGPROCEDURE,TEXT[],TEXT[],REGCLASS,TEXT[])
+    IS 'schedule a pg_tkach_sheduler task, returns the task_id of the scheduled task';
+
+-- прогноз количества выполнений задач по интервалам времени
+CREATE FUNCTION ts.forecast(
+    from_time TIMESTAMPTZ,
+    to_time TIMESTAMPTZ,
+    bucket INTERVAL DEFAULT '1 minute',
+    OUT bucket_start TIMESTAMPTZ,
+    OUT executions BIGINT,
+    OUT avg_duration_ms DOUBLE PRECISION,
+    OUT total_duration_ms DOUBLE PRECISION
+)
+RETURNS SETOF RECORD
+LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', 'ts_forecast';
+COMMENT ON FUNCTION ts.forecast(TIMESTAMPTZ,TIMESTAMPTZ,INTERVAL)
+    IS 'forecast the number of task executions and their expected duration per time bucket';
+
+-- статистика планировщика
+CREATE FUNCTION ts.stats(
+    OUT name TEXT,
+    OUT value BIGINT
+)
+RETURNS SETOF RECORD
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'ts_stats';
+COMMENT ON FUNCTION ts.stats()
+    IS 'pg_tkach_scheduler worker statistics';
+
+-- статистика планировщика в текстовом формате Prometheus
+CREATE FUNCTION ts.metrics_text()
+RETURNS TEXT
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'ts_metrics_text';
+COMMENT ON FUNCTION ts.metrics_text()
+    IS 'pg_tkach_scheduler worker statistics in the Prometheus text format';
+
+
+-- запланировать задачу, которая выполняется пачками, пока обрабатывает строки
+CREATE FUNCTION ts.schedule_batch(
+    command TEXT,
+    time_exec TIMESTAMPTZ,
+    note TEXT DEFAULT NULL
+)
+RETURNS BIGINT
+LANGUAGE plpgsql
+AS $$
+BEGIN
+    RETURN ts.schedule(
+        'batch'::ts.TASK_TYPE,
+        command,
+        time_exec,
+        NULL::INTERVAL,
+        NULL::BIGINT,
+        NULL::TIMESTAMPTZ,
+        note);
+END;
+$$;
+COMMENT ON FUNCTION ts.schedule_batch(TEXT,TIMESTAMPTZ,TEXT)
+    IS 'schedule a pg_tkach_sheduler batch task, returns the task_id of the scheduled task';
+
+
+-- ресурсы, потраченные на выполнения задач
+CREATE FUNCTION ts.task_usage_stats(
+    OUT task_id BIGINT,
+    OUT calls BIGINT,
+    OUT shared_blks_hit BIGINT,
+    OUT shared_blks_read BIGINT,
+    OUT shared_blks_dirtied BIGINT,
+    OUT shared_blks_written BIGINT,
+    OUT wal_records BIGINT,
+    OUT wal_fpi BIGINT,
+    OUT wal_bytes BIGINT,
+    OUT user_time_ms DOUBLE PRECISION,
+    OUT system_time_ms DOUBLE PRECISION
+)
+RETURNS SETOF RECORD
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'ts_task_usage';
+COMMENT ON FUNCTION ts.task_usage_stats()
+    IS 'buffer, WAL and CPU usage of pg_tkach_scheduler task executions';
+
+CREATE VIEW ts.task_usage AS
+    SELECT u.task_id, d.command, d.username, d.database, u.calls,
+           u.shared_blks_hit, u.shared_blks_read,
+           u.shared_blks_dirtied, u.shared_blks_written,
+           u.wal_records, u.wal_fpi, u.wal_bytes,
+           u.user_time_ms, u.system_time_ms
+    FROM ts.task_usage_stats() u
+    LEFT JOIN ts.task_def d USING (task_id);
+
+
+-- запланировать прямой вызов функции или процедуры
+-- с exec_interval задача повторяется, без него выполняется один раз
+CREATE FUNCTION ts.schedule_call(
+    func REGPROCEDURE,
+    args TEXT[],
+    time_next_exec TIMESTAMPTZ,
+    exec_interval INTERVAL DEFAULT NULL,
+    note TEXT DEFAULT NULL
+)
+RETURNS BIGINT
+LANGUAGE plpgsql
+AS $$
+BEGIN
+    RETURN ts.schedule(
+        CASE WHEN exec_interval IS NULL THEN 'single'::ts.TASK_TYPE
+             ELSE 'repeat'::ts.TASK_TYPE END,
+        NULL::TEXT,
+        time_next_exec,
+        exec_interval,
+        NULL::BIGINT,
+        NULL::TIMESTAMPTZ,
+        note,
+        func => func,
+        args => args);
+END;
+$$;
+COMMENT ON FUNCTION ts.schedule_call(REGPROCEDURE,TEXT[],TIMESTAMPTZ,INTERVAL,TEXT)
+    IS 'schedule a direct call of a function or procedure, returns the task_id of the scheduled task';
+
+
+-- запланировать fan-out задачу: command с {target} выполняется параллельно
+-- для каждой секции parent, с exec_interval задача повторяется
+CREATE FUNCTION ts.schedule_fanout(
+    command TEXT,
+    parent REGCLASS,
+    time_next_exec TIMESTAMPTZ,
+    exec_interval INTERVAL DEFAULT NULL,
+    note TEXT DEFAULT NULL
+)
+RETURNS BIGINT
+LANGUAGE plpgsql
+AS $$
+BEGIN
+    RETURN ts.schedule(
+        CASE WHEN exec_interval IS NULL THEN 'single'::ts.TASK_TYPE
+             ELSE 'repeat'::ts.TASK_TYPE END,
+        command,
+        time_next_exec,
+        exec_interval,
+        NULL::BIGINT,
+        NULL::TIMESTAMPTZ,
+        note,
+        fanout_parent => parent);
+END;
+$$;
+COMMENT ON FUNCTION ts.schedule_fanout(TEXT,REGCLASS,TIMESTAMPTZ,INTERVAL,TEXT)
+    IS 'schedule a task run in parallel for every partition of a table, returns the task_id of the scheduled task';
+
+
+-- время планировщика и виртуальное время для тестов и бенчмарков
+CREATE FUNCTION ts.now()
+RETURNS TIMESTAMPTZ
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'ts_now';
+COMMENT ON FUNCTION ts.now()
+    IS 'current pg_tkach_scheduler time, virtual if the virtual clock is enabled';
+
+CREATE FUNCTION ts.set_virtual_time(virtual_time TIMESTAMPTZ)
+RETURNS VOID
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'ts_set_virtual_time';
+COMMENT ON FUNCTION ts.set_virtual_time(TIMESTAMPTZ)
+    IS 'switch pg_tkach_scheduler workers to the virtual clock, NULL switches back to real time';
+
+CREATE FUNCTION ts.advance_time(step INTERVAL, wait BOOLEAN DEFAULT true)
+RETURNS TIMESTAMPTZ
+LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', 'ts_advance_time';
+COMMENT ON FUNCTION ts.advance_time(INTERVAL,BOOLEAN)
+    IS 'advance the virtual clock, optionally waiting for workers to catch up';
+
+REVOKE ALL ON FUNCTION ts.set_virtual_time(TIMESTAMPTZ) FROM PUBLIC;
+REVOKE ALL ON FUNCTION ts.advance_time(INTERVAL,BOOLEAN) FROM PUBLIC;
+
+
+-- очередь разовых задач
+-- задачи только добавляются: выполненные отмечаются в ts.queue_done,
+-- а место освобождается удалением целых часовых секций, поэтому очередь
+-- не оставляет мертвых строк и не нагружает autovacuum
+CREATE TABLE ts.queue (
+    job_id BIGINT NOT NULL DEFAULT pg_catalog.nextval('ts.task_id_seq'),
+    time_exec TIMESTAMPTZ NOT NULL,
+    command TEXT NOT NULL,
+    note TEXT,
+    username TEXT NOT NULL DEFAULT current_user,
+    database TEXT NOT NULL DEFAULT pg_catalog.current_database()
+) PARTITION BY RANGE (time_exec);
+
+CREATE INDEX queue_time_exec_idx ON ts.queue (time_exec);
+
+-- отметки о выполнении, секционированы так же, как ts.queue
+CREATE TABLE ts.queue_done (
+    job_id BIGINT NOT NULL,
+    time_exec TIMESTAMPTZ NOT NULL,
+    ok BOOLEAN NOT NULL
+) PARTITION BY RANGE (time_exec);
+
+CREATE INDEX queue_done_job_idx ON ts.queue_done (time_exec, job_id);
+
+-- задачи вне часовых секций (например, далеко в будущем)
+CREATE TABLE ts.queue_default PARTITION OF ts.queue DEFAULT;
+CREATE TABLE ts.queue_done_default PARTITION OF ts.queue_done DEFAULT;
+
+-- поставить разовую задачу в очередь
+-- запрос не проверяется, ошибка будет при выполнении
+-- время в прошлом заменяется текущим временем планировщика: воркер
+-- не просматривает давно выбранную часть очереди, и такая задача
+-- никогда бы не выполнилась
+CREATE FUNCTION ts.enqueue(
+    command TEXT,
+    time_exec TIMESTAMPTZ DEFAULT now(),
+    note TEXT DEFAULT NULL
+)
+RETURNS BIGINT
+LANGUAGE sql
+AS $$
+    INSERT INTO ts.queue (command, time_exec, note)
+    VALUES ($1, greatest($2, ts.now()), $3)
+    RETURNING job_id;
+$$;
+COMMENT ON FUNCTION ts.enqueue(TEXT,TIMESTAMPTZ,TEXT)
+    IS 'append a one-shot job to the pg_tkach_scheduler queue, returns its job_id';
+
+-- обслуживание секций очереди, вызывается воркером
+-- создает часовые секции на ahead_hours часов вперед от from_time
+-- и удаляет секции, которые закончились раньше keep_before
+-- строки очереди никогда не удаляются по одной: место освобождается
+-- только удалением или очисткой целых таблиц
+CREATE FUNCTION ts.queue_maintain(
+    from_time TIMESTAMPTZ,
+    ahead_hours INTEGER,
+    keep_before TIMESTAMPTZ
+)
+RETURNS VOID
+LANGUAGE plpgsql
+AS $$
+DECLARE
+    first_hour TIMESTAMPTZ;
+    horizon_end TIMESTAMPTZ;
+    part_start TIMESTAMPTZ;
+    suffix TEXT;
+    tbl TEXT;
+    rebuild BOOLEAN;
+BEGIN
+    -- если на таблице есть блокировка, обслуживание откладывается
+    -- до следующего раза
+    PERFORM pg_catalog.set_config('lock_timeout', '1s', true);
+
+    -- секции считаются по UTC, чтобы не зависеть от часового пояса сессии
+    first_hour := pg_catalog.date_trunc('hour', from_time AT TIME ZONE 'UTC')
+                      AT TIME ZONE 'UTC';
+    horizon_end := pg_catalog.date_trunc(
+                       'hour',
+                       (from_time + pg_catalog.make_interval(hours => ahead_hours))
+                           AT TIME ZONE 'UTC')
+                       AT TIME ZONE 'UTC' + '1 hour'::INTERVAL;
+
+    FOREACH tbl IN ARRAY ARRAY['queue', 'queue_done'] LOOP
+        -- секцию нельзя создать, пока в секции по умолчанию есть строки
+        -- её часа, а старые строки из секции по умолчанию не уходят
+        -- вместе с часовыми секциями; в обоих случаях секция по умолчанию
+        -- отсоединяется, вместо неё создается пустая, нужные строки
+        -- заново вставляются в очередь, а прежняя удаляется целиком
+        -- в секцию по умолчанию попадают только задачи дальше
+        -- ahead_hours, поэтому копируется немного строк
+        EXECUTE pg_catalog.format(
+            'SELECT EXISTS (SELECT 1 FROM ts.%I '
+            'WHERE time_exec >= $1 AND time_exec < $2 OR time_exec < $3)',
+            tbl || '_default')
+            INTO rebuild
+            USING first_hour, horizon_end, keep_before;
+
+        IF rebuild THEN
+            BEGIN
+                EXECUTE pg_catalog.format(
+                    'ALTER TABLE ts.%I DETACH PARTITION ts.%I',
+                    tbl, tbl || '_default');
+                EXECUTE pg_catalog.format(
+                    'ALTER TABLE ts.%I RENAME TO %I',
+                    tbl || '_default', tbl || '_default_old');
+                EXECUTE pg_catalog.format(
+                    'CREATE TABLE ts.%I PARTITION OF ts.%I DEFAULT',
+                    tbl || '_default', tbl);
+            EXCEPTION WHEN lock_not_available THEN
+                rebuild := false;
+            END;
+        END IF;
+
+        FOR part_start IN
+            SELECT pg_catalog.generate_series(first_hour,
+                                              horizon_end - '1 hour'::INTERVAL,
+                                              '1 hour')
+        LOOP
+            suffix := pg_catalog.to_char(part_start AT TIME ZONE 'UTC',
+                                         'YYYYMMDD"_"HH24');
+
+            CONTINUE WHEN pg_catalog.to_regclass(
+                pg_catalog.format('ts.%I', tbl || '_' || suffix)) IS NOT NULL;
+
+            -- строки часа могли попасть в секцию по умолчанию после
+            -- проверки выше, тогда секция создается в следующий раз
+            BEGIN
+                EXECUTE pg_catalog.format(
+                    'CREATE TABLE ts.%I PARTITION OF ts.%I '
+                    'FOR VALUES FROM (%L) TO (%L)',
+                    tbl || '_' || suffix, tbl,
+                    part_start, part_start + '1 hour'::INTERVAL);
+            EXCEPTION WHEN check_violation OR lock_not_available THEN
+                NULL;
+            END;
+        END LOOP;
+
+        IF rebuild THEN
+            EXECUTE pg_catalog.format(
+                'INSERT INTO ts.%I SELECT * FROM ts.%I '
+                'WHERE $1 IS NULL OR time_exec >= $1',
+                tbl, tbl || '_default_old')
+                USING keep_before;
+            EXECUTE pg_catalog.format('DROP TABLE ts.%I', tbl || '_default_old');
+        END IF;
+    END LOOP;
+
+    IF keep_before IS NULL THEN
+        RETURN;
+    END IF;
+
+    -- старые секции удаляются целиком, а если на таблице есть
+    -- блокировка - очищаются и удаляются при следующем обслуживании
+    FOR tbl IN
+        SELECT c.relname
+        FROM pg_catalog.pg_inherits i
+        JOIN pg_catalog.pg_class c ON c.oid = i.inhrelid
+        WHERE i.inhparent IN ('ts.queue'::REGCLASS, 'ts.queue_done'::REGCLASS)
+          AND c.relname ~ '_\d{8}_\d{2}$'
+          AND (pg_catalog.overlay(pg_catalog.right(c.relname, 11)
+                                  PLACING ' ' FROM 9) || ':00')::TIMESTAMP
+                  AT TIME ZONE 'UTC' + '1 hour'::INTERVAL <= keep_before
+    LOOP
+        BEGIN
+            EXECUTE pg_catalog.format('DROP TABLE ts.%I', tbl);
+        EXCEPTION WHEN lock_not_available THEN
+            BEGIN
+                EXECUTE pg_catalog.format('TRUNCATE ts.%I', tbl);
+            EXCEPTION WHEN lock_not_available THEN
+                NULL;
+            END;
+        END;
+    END LOOP;
+END;
+$$;
+COMMENT ON FUNCTION ts.queue_maintain(TIMESTAMPTZ,INTEGER,TIMESTAMPTZ)
+    IS 'create upcoming partitions of the pg_tkach_scheduler queue and drop the finished ones';
+
+-- ts.schedule_single может ставить задачу в очередь
+CREATE OR REPLACE FUNCTION ts.schedule_single(
+    command TEXT,
+    time_exec TIMESTAMPTZ,
+    note TEXT DEFAULT NULL
+)
+RETURNS BIGINT
+LANGUAGE plpgsql
+AS $$
+BEGIN
+    -- с pg_tkach_scheduler.queue_single = on задача ставится в очередь
+    IF pg_catalog.current_setting('pg_tkach_scheduler.queue_single', true) = 'on' THEN
+        RETURN ts.enqueue(command, time_exec, note);
+    END IF;
+
+    RETURN ts.schedule(
+        'single'::ts.TASK_TYPE,
+        command,
+        time_exec,
+        NULL::INTERVAL,
+        NULL::BIGINT,
+        NULL::TIMESTAMPTZ,
+        note);
+END;
+$$;
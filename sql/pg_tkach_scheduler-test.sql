@@ -2,6 +2,68 @@
 
 CREATE EXTENSION IF NOT EXISTS pg_tkach_scheduler;
 
-SELECT * FROM ts.task;
+SELECT task_id, command, type, exec_count FROM ts.task;
 
-DROP EXTENSION pg_tkach_scheduler;
\ No newline at end of file
+-- виртуальное время планировщика
+SELECT ts.set_virtual_time('2030-01-01 00:00:00+00');
+SELECT to_char(ts.now() AT TIME ZONE 'UTC', 'YYYY-MM-DD HH24:MI:SS') AS scheduler_clock_utc;
+SELECT to_char(ts.advance_time('90 minutes', false) AT TIME ZONE 'UTC', 'YYYY-MM-DD HH24:MI:SS') AS scheduler_clock_utc;
+SELECT ts.advance_time('-1 minute', false);
+SELECT ts.set_virtual_time(NULL);
+SELECT abs(extract(epoch FROM ts.now() - clock_timestamp())) < 60 AS real_clock;
+SELECT ts.advance_time('1 minute', false);
+
+-- расписание и прогноз
+SELECT ts.schedule_repeat('SELECT 1', '2030-01-01 00:00:00+00', '15 minutes') > 0 AS scheduled;
+SELECT ts.schedule_single('SELECT 2', '2030-01-01 06:00:00+00') > 0 AS scheduled;
+SELECT command, type, note IS NULL AS no_note FROM ts.task ORDER BY task_id;
+SELECT to_char(bucket_start AT TIME ZONE 'UTC', 'HH24:MI') AS bucket, executions
+FROM ts.forecast('2030-01-01 00:00:00+00', '2030-01-01 08:00:00+00', '2 hours');
+
+-- fan-out задача
+SELECT ts.schedule('single', 'SELECT 3', '2030-01-02 00:00:00+00', fanout_targets => '{a}');
+SELECT ts.schedule('repeat', 'SELECT length(''{target}'')', '2030-01-02 00:00:00+00', '1 day', fanout_targets => '{a,bb}') > 0 AS scheduled;
+SELECT ts.schedule('single', 'SELECT count(*) FROM {target}', '2030-01-02 00:00:00+00', fanout_targets => '{ts.task_def,ts.missing}');
+SELECT command, fanout_targets, last_run_ok FROM ts.task WHERE fanout_targets IS NOT NULL;
+
+DROP EXTENSION pg_tkach_scheduler;
+
+-- выполнение задач по виртуальному времени
+-- воркер работает в базе postgres, поэтому задачи планируются в ней
+\c postgres
+CREATE EXTENSION pg_tkach_scheduler;
+-- воркер перезапускается, пока расширения нет, ждем его первую итерацию
+DO $$
+BEGIN
+    FOR i IN 1..300 LOOP
+        EXIT WHEN (SELECT value FROM ts.stats() WHERE name = 'ticks') > 0;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+END
+$$;
+SELECT ts.set_virtual_time('2030-01-01 00:00:00+00');
+SELECT ts.schedule_repeat('SELECT 1', '2030-01-01 00:30:00+00', '15 minutes') > 0 AS scheduled;
+SELECT command, exec_count, last_run_ok FROM ts.task;
+SELECT to_char(ts.advance_time('1 hour', true) AT TIME ZONE 'UTC', 'HH24:MI') AS scheduler_clock_utc;
+SELECT command, exec_count, last_run_ok, to_char(time_next_exec AT TIME ZONE 'UTC', 'HH24:MI') AS next_exec FROM ts.task;
+-- fan-out задача выполняется для каждой цели
+SELECT ts.schedule('repeat', 'SELECT length(''{target}'')', '2030-01-01 01:30:00+00', '1 day', fanout_targets => '{a,bb}') > 0 AS scheduled;
+SELECT to_char(ts.advance_time('60 minutes', true) AT TIME ZONE 'UTC', 'HH24:MI') AS scheduler_clock_utc;
+SELECT command, exec_count, last_run_ok FROM ts.task WHERE fanout_targets IS NOT NULL;
+-- процедура задачи может фиксировать транзакцию
+CREATE TABLE ts_commit_log (step INTEGER);
+CREATE PROCEDURE ts_commit_proc() LANGUAGE plpgsql AS $$
+BEGIN
+    INSERT INTO ts_commit_log VALUES (1);
+    COMMIT;
+    INSERT INTO ts_commit_log VALUES (2);
+END
+$$;
+SELECT ts.schedule_repeat('CALL ts_commit_proc()', '2030-01-01 02:30:00+00', '1 day') > 0 AS scheduled;
+SELECT to_char(ts.advance_time('30 minutes', true) AT TIME ZONE 'UTC', 'HH24:MI') AS scheduler_clock_utc;
+SELECT command, exec_count, last_run_ok FROM ts.task WHERE command LIKE 'CALL%';
+SELECT step FROM ts_commit_log ORDER BY step;
+SELECT ts.set_virtual_time(NULL);
+DROP EXTENSION pg_tkach_scheduler;
+DROP PROCEDURE ts_commit_proc();
+DROP TABLE ts_commit_log;
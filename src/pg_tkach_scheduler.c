@@ -4,25 +4,57 @@
 #include "postgres.h"
 #include "fmgr.h"
 #include "postmaster/bgworker.h"
+#include "postmaster/postmaster.h"
 #include "utils/guc.h"
 #include "datatype/timestamp.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "libpq/libpq-be.h"
 #include "executor/spi.h"
 #include "utils/elog.h"
 #include "utils/palloc.h"
 #include "utils/timestamp.h"
+#include "catalog/namespace.h"
+#include "common/hashfn.h"
+#include "parser/parser.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+#include <limits.h>
 #include <stdlib.h>
 
 #include "pg_tkach_scheduler.h"
 #include "task.h"
+#include "ts_admission.h"
 #include "ts_background_worker.h"
+#include "ts_call.h"
+#include "ts_executor.h"
+#include "ts_fanout.h"
+#include "ts_metrics.h"
+#include "ts_queue.h"
+#include "ts_settings.h"
+#include "ts_shmem.h"
+#include "ts_snapshot.h"
+#include "ts_task_usage.h"
 
 PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(ts_schedule);
 PG_FUNCTION_INFO_V1(ts_unschedule);
 
+// сколько результатов проверки запросов хранить в кеше
+#define VALIDATION_CACHE_SIZE 10000
+
+int validation_mode = TS_VALIDATION_FULL;
+
+static const struct config_enum_entry validation_options[] = {
+    { "full", TS_VALIDATION_FULL, false },
+    { "parse", TS_VALIDATION_PARSE, false },
+    { "deferred", TS_VALIDATION_DEFERRED, false },
+    { NULL, 0, false },
+};
+
 
 /*
  * эта функция вызывается инфраструктурой Postgres при загрузке расширения
@@ -36,7 +68,7 @@ _PG_init()
         "pg_tkach_scheduler.task_check_interval",
         "Interval for checking new tasks (in seconds)",
         "Determines how often the background worker checks for new tasks to "
-        "execute.",
+        "execute. Checks are aligned to multiples of the interval.",
         &task_check_interval,
         10,
         1,
@@ -47,23 +79,473 @@ _PG_init()
         NULL,
         NULL);
 
-    BackgroundWorker worker;
-    memset(&worker, 0, sizeof(BackgroundWorker));
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.task_check_interval_ms",
+        "Interval for checking new tasks with millisecond precision",
+        "Overrides task_check_interval when set. Zero uses "
+        "task_check_interval, values below 10ms are raised to 10ms.",
+        &task_check_interval_ms,
+        0,
+        0,
+        3600000,
+        PGC_SIGHUP,
+        GUC_UNIT_MS,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomBoolVariable(
+        "pg_tkach_scheduler.adaptive_tick",
+        "Adapt the check interval and batch sizes to the load",
+        "Checks run every min_check_interval while tasks are backlogged and "
+        "at the next due time when idle, task_check_interval is the longest "
+        "wait. Batches are sized to fit tick_time_budget.",
+        &adaptive_tick,
+        true,
+        PGC_SIGHUP,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.min_check_interval",
+        "Shortest interval between checks under backlog",
+        NULL,
+        &min_check_interval,
+        10,
+        0,
+        3600000,
+        PGC_SIGHUP,
+        GUC_UNIT_MS,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.tick_time_budget",
+        "Time a check should take at most",
+        "Fetched batches of tasks and queue jobs are sized from their "
+        "measured cost to fit this budget.",
+        &tick_time_budget,
+        1000,
+        1,
+        3600000,
+        PGC_SIGHUP,
+        GUC_UNIT_MS,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomEnumVariable(
+        "pg_tkach_scheduler.validation",
+        "How commands are validated when a task is scheduled",
+        "full plans the command, parse only checks its syntax, deferred "
+        "validates it in the worker before the first run.",
+        &validation_mode,
+        TS_VALIDATION_FULL,
+        validation_options,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.num_shards",
+        "Number of scheduler workers",
+        "Each worker owns the tasks with hash(task_id) % num_shards equal to "
+        "its shard number.",
+        &num_shards,
+        1,
+        1,
+        TS_MAX_SHARDS,
+        PGC_POSTMASTER,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.batch_chunk_pause",
+        "Pause between chunks of a batch task",
+        NULL,
+        &batch_chunk_pause,
+        100,
+        0,
+        3600000,
+        PGC_SIGHUP,
+        GUC_UNIT_MS,
+        NULL,
+        NULL,
+        NULL);
 
-    worker.bgw_flags =
-        BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
-    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
-    worker.bgw_restart_time = 5;
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.batch_max_chunks_per_tick",
+        "Maximum number of chunks of one batch task per check",
+        "An unfinished batch task continues on the next check.",
+        &batch_max_chunks_per_tick,
+        100,
+        1,
+        INT_MAX,
+        PGC_SIGHUP,
+        0,
+        NULL,
+        NULL,
+        NULL);
 
-    worker.bgw_main_arg = Int32GetDatum(0);
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.batch_max_wal_rate",
+        "Maximum WAL generated by a batch task per second",
+        "Zero disables WAL throttling.",
+        &batch_max_wal_rate,
+        0,
+        0,
+        INT_MAX,
+        PGC_SIGHUP,
+        GUC_UNIT_KB,
+        NULL,
+        NULL,
+        NULL);
 
-    worker.bgw_notify_pid = 0;
-    sprintf(worker.bgw_library_name, "pg_tkach_scheduler");
-    snprintf(worker.bgw_name, BGW_MAXLEN, "pg_tkach_scheduler worker");
-    snprintf(worker.bgw_type, BGW_MAXLEN, "pg_tkach_scheduler worker");
-    sprintf(worker.bgw_function_name, "TSMain");
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.batch_retry_delay",
+        "Delay before a batch task continues after a failed chunk",
+        NULL,
+        &batch_retry_delay,
+        60,
+        1,
+        86400,
+        PGC_SIGHUP,
+        GUC_UNIT_S,
+        NULL,
+        NULL,
+        NULL);
 
-    RegisterBackgroundWorker(&worker);
+    DefineCustomBoolVariable(
+        "pg_tkach_scheduler.coalesce_tasks",
+        "Run identical due tasks once per check",
+        "Tasks with the same command, user and database that are due "
+        "at the same check are executed once. Enable only when "
+        "scheduled commands are idempotent.",
+        &coalesce_tasks,
+        false,
+        PGC_SIGHUP,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.max_rate_groups",
+        "Maximum number of rate limit groups",
+        "Token buckets of rate limit groups are kept in shared memory.",
+        &max_rate_groups,
+        64,
+        1,
+        10000,
+        PGC_POSTMASTER,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.max_tracked_tasks",
+        "Maximum number of tasks with tracked resource usage",
+        "Buffer, WAL and CPU usage of tasks is kept in shared memory, "
+        "tasks not executed recently are evicted when the limit is reached.",
+        &max_tracked_tasks,
+        1000,
+        100,
+        1000000,
+        PGC_POSTMASTER,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.admission_max_active_backends",
+        "Defer deferrable tasks while more backends are active",
+        "Zero disables this check.",
+        &admission_max_active_backends,
+        0,
+        0,
+        MAX_BACKENDS,
+        PGC_SIGHUP,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.admission_max_lock_waits",
+        "Defer deferrable tasks while more backends wait for locks",
+        "Zero disables this check.",
+        &admission_max_lock_waits,
+        0,
+        0,
+        MAX_BACKENDS,
+        PGC_SIGHUP,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomBoolVariable(
+        "pg_tkach_scheduler.admission_defer_on_checkpoint",
+        "Defer deferrable tasks while a checkpoint is in progress",
+        NULL,
+        &admission_defer_on_checkpoint,
+        false,
+        PGC_SIGHUP,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.admission_max_replication_lag",
+        "Defer deferrable tasks while a replica lags behind more than this",
+        "Zero disables this check.",
+        &admission_max_replication_lag,
+        0,
+        0,
+        INT_MAX,
+        PGC_SIGHUP,
+        GUC_UNIT_KB,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.admission_max_delay",
+        "Maximum delay of a deferrable task under load",
+        "A task that is late by more than this runs regardless of load.",
+        &admission_max_delay,
+        300,
+        0,
+        INT_MAX,
+        PGC_SIGHUP,
+        GUC_UNIT_S,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.max_executors",
+        "Maximum number of executor backends",
+        "Tasks run in executor backends connected to the task database as "
+        "the task owner, one executor per user and database pair. Zero runs "
+        "tasks in the scheduler worker itself.",
+        &max_executors,
+        4,
+        0,
+        MAX_BACKENDS,
+        PGC_POSTMASTER,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.executor_idle_timeout",
+        "Time after which an idle executor backend exits",
+        NULL,
+        &executor_idle_timeout,
+        60000,
+        1000,
+        INT_MAX,
+        PGC_SIGHUP,
+        GUC_UNIT_MS,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomStringVariable(
+        "pg_tkach_scheduler.task_settings_allowlist",
+        "Parameters that can be set for a task",
+        "Comma-separated list of parameters allowed in the settings of "
+        "ts.schedule, they are applied to the task transaction only.",
+        &task_settings_allowlist,
+        "work_mem,maintenance_work_mem,hash_mem_multiplier,"
+        "max_parallel_workers_per_gather,max_parallel_maintenance_workers,"
+        "statement_timeout,lock_timeout,jit,random_page_cost,"
+        "effective_io_concurrency",
+        PGC_SIGHUP,
+        GUC_LIST_INPUT,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.queue_batch_size",
+        "Maximum number of queue jobs fetched at once",
+        "A worker keeps fetching without waiting for the next check "
+        "while full batches are returned.",
+        &queue_batch_size,
+        10000,
+        1,
+        1000000,
+        PGC_SIGHUP,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.queue_lookback",
+        "How far back a drained queue is still scanned",
+        "Jobs enqueued by transactions longer than this with an already "
+        "passed time may be missed.",
+        &queue_lookback,
+        300,
+        1,
+        INT_MAX,
+        PGC_SIGHUP,
+        GUC_UNIT_S,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.queue_retention",
+        "How long done queue jobs are kept",
+        "Hourly queue partitions are dropped once they are older than this.",
+        &queue_retention,
+        3600,
+        0,
+        INT_MAX,
+        PGC_SIGHUP,
+        GUC_UNIT_S,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.queue_partitions_ahead",
+        "Number of hourly queue partitions created in advance",
+        "Jobs further in the future go to the default partition and are "
+        "moved when their partition is created.",
+        &queue_partitions_ahead,
+        24,
+        1,
+        24 * 366,
+        PGC_SIGHUP,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.snapshot_interval",
+        "Interval between snapshots of the worker state",
+        "Workers write their upcoming tasks, statistics and rate limit "
+        "state to pg_stat and load them on start. Zero disables snapshots.",
+        &snapshot_interval,
+        60,
+        0,
+        86400,
+        PGC_SIGHUP,
+        GUC_UNIT_S,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.metrics_interval",
+        "Interval between writes of the metrics file",
+        "The first worker writes metrics in the Prometheus text format "
+        "to pg_tkach_scheduler.prom in the data directory. "
+        "Zero disables the file.",
+        &metrics_file_interval,
+        15,
+        0,
+        86400,
+        PGC_SIGHUP,
+        GUC_UNIT_S,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.fanout_max_parallel",
+        "Maximum number of parts of a fanout task run at once",
+        "Parts of a fanout task run on executors, so the limit is "
+        "also capped by max_executors.",
+        &fanout_max_parallel,
+        4,
+        1,
+        MAX_BACKENDS,
+        PGC_SIGHUP,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomIntVariable(
+        "pg_tkach_scheduler.queue_max_parallel",
+        "Maximum number of queue jobs run at once by one worker",
+        "Queue jobs run on executors, so the limit is also capped by "
+        "max_executors.",
+        &queue_max_parallel,
+        4,
+        1,
+        MAX_BACKENDS,
+        PGC_SIGHUP,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    DefineCustomBoolVariable(
+        "pg_tkach_scheduler.queue_single",
+        "Put tasks of ts.schedule_single into the queue",
+        NULL,
+        &queue_single,
+        false,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+
+    // общую память и воркеры можно зарегистрировать
+    // только из shared_preload_libraries
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+    TSShmemInit();
+
+    // по одному воркеру на каждый шард,
+    // номер шарда передается воркеру через bgw_main_arg
+    for (int shard = 0; shard < num_shards; shard++)
+    {
+        BackgroundWorker worker;
+        memset(&worker, 0, sizeof(BackgroundWorker));
+
+        worker.bgw_flags =
+            BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+        worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+        worker.bgw_restart_time = 5;
+
+        worker.bgw_main_arg = Int32GetDatum(shard);
+
+        worker.bgw_notify_pid = 0;
+        sprintf(worker.bgw_library_name, "pg_tkach_scheduler");
+        if (num_shards == 1)
+            snprintf(worker.bgw_name, BGW_MAXLEN, "pg_tkach_scheduler worker");
+        else
+            snprintf(worker.bgw_name,
+                     BGW_MAXLEN,
+                     "pg_tkach_scheduler worker %d",
+                     shard);
+        snprintf(worker.bgw_type, BGW_MAXLEN, "pg_tkach_scheduler worker");
+        sprintf(worker.bgw_function_name, "TSMain");
+
+        RegisterBackgroundWorker(&worker);
+    }
 
     elog(DEBUG1, "end register background worker pg_tkach_scheduler");
 }
@@ -97,16 +579,24 @@ ts_schedule(PG_FUNCTION_ARGS)
     int indRepeatLimit = 4;
     int indUntil = 5;
     int indNote = 6;
+    int indRateGroup = 7;
+    int indDeferrable = 8;
+    int indIdempotencyKey = 9;
+    int indFunc = 10;
+    int indArgs = 11;
+    int indSettings = 12;
+    int indFanoutParent = 13;
+    int indFanoutTargets = 14;
 
     elog(LOG, "pg_tkach_scheduler ts_schedule");
-    Task *task = palloc(sizeof(Task));
+    Task *task = palloc0(sizeof(Task));
 
     TaskType taskType;
 
     text *commandText;
     const char *command;
 
-    Interval *exec_interval;
+    Interval *exec_interval = NULL;
 
     TimestampTz timeNextExec;
     int64 repeat_limit = 0;
@@ -115,6 +605,8 @@ ts_schedule(PG_FUNCTION_ARGS)
     text *noteText;
     const char *note = NULL;
 
+    const char *rateGroup = NULL;
+
     /*
         * проверки, проверки и ещё раз проверки
         */
@@ -136,6 +628,7 @@ ts_schedule(PG_FUNCTION_ARGS)
     switch (taskType)
     {
     case Single:
+    case Batch:
         break;
 
     case Repeat:
@@ -185,7 +678,24 @@ ts_schedule(PG_FUNCTION_ARGS)
 
     elog(DEBUG1, "pg_tkach_scheduler ts_schedule 3");
 
-    if (PG_ARGISNULL(indCommand))
+    // в режиме вызова задача хранит функцию и аргументы,
+    // а command строится по ним
+    Oid func = PG_ARGISNULL(indFunc) ? InvalidOid : PG_GETARG_OID(indFunc);
+    char **args = NULL;
+    int nargs = 0;
+
+    if (OidIsValid(func))
+    {
+        if (!PG_ARGISNULL(indCommand))
+            elog(ERROR, "command and func cannot be used together");
+
+        if (!PG_ARGISNULL(indArgs))
+            TSCallArgsFromArray(PG_GETARG_ARRAYTYPE_P(indArgs), &args, &nargs);
+
+        command = TSCallCommand(func, args, nargs, taskType);
+        elog(DEBUG1, "ts_schedule - call: %s", command);
+    }
+    else if (PG_ARGISNULL(indCommand))
         elog(ERROR, "command must be NOT NULL");
     else
     {
@@ -211,9 +721,78 @@ ts_schedule(PG_FUNCTION_ARGS)
         note = text_to_cstring(noteText);
     }
 
+    // группа ограничения частоты, её существование проверит внешний ключ
+    // имя хранится в общей памяти, длинное имя не нашлось бы там
+    if (!PG_ARGISNULL(indRateGroup))
+    {
+        rateGroup = text_to_cstring(PG_GETARG_TEXT_P(indRateGroup));
+        if (strlen(rateGroup) >= NAMEDATALEN)
+            ereport(ERROR,
+                    (errcode(ERRCODE_NAME_TOO_LONG),
+                     errmsg("rate_group must be shorter than %d bytes",
+                            NAMEDATALEN)));
+    }
+
+    // можно ли откладывать задачу, пока сервер перегружен
+    bool deferrable = PG_ARGISNULL(indDeferrable) ? false
+                                                  : PG_GETARG_BOOL(indDeferrable);
+
+    // ключ, по которому повторное планирование обновляет задачу,
+    // а не создает её копию
+    const char *idempotencyKey = NULL;
+    if (!PG_ARGISNULL(indIdempotencyKey))
+        idempotencyKey = text_to_cstring(PG_GETARG_TEXT_P(indIdempotencyKey));
+
+    // настройки задачи вида name=value, проверяются сразу,
+    // чтобы ошибка не всплыла только при выполнении
+    char **settings = NULL;
+    int nsettings = 0;
+    if (!PG_ARGISNULL(indSettings))
+    {
+        TSCallArgsFromArray(
+            PG_GETARG_ARRAYTYPE_P(indSettings), &settings, &nsettings);
+        TSSettingsCheck(settings, nsettings);
+    }
+
+    // fan-out задача: команда с {target} выполняется для каждой секции
+    // fanout_parent или для каждого элемента fanout_targets
+    task->fanout_parent =
+        PG_ARGISNULL(indFanoutParent) ? InvalidOid
+                                      : PG_GETARG_OID(indFanoutParent);
+    if (!PG_ARGISNULL(indFanoutTargets))
+        TSCallArgsFromArray(PG_GETARG_ARRAYTYPE_P(indFanoutTargets),
+                            &task->fanout_targets,
+                            &task->nfanout_targets);
+
+    // проверяются команды для каждой цели из списка, а для секций -
+    // команда для самой таблицы, так как секции могут появиться позже
+    bool validQuery = true;
+    if (TSFanoutTask(task))
+    {
+        task->command = command;
+        task->type = taskType;
+        task->func = func;
+        TSFanoutCheck(task);
+
+        if (OidIsValid(task->fanout_parent))
+            validQuery = isValidQuery(TSFanoutCommand(
+                command,
+                DatumGetCString(DirectFunctionCall1(
+                    regclassout, ObjectIdGetDatum(task->fanout_parent)))));
+        else
+        {
+            for (int i = 0; i < task->nfanout_targets && validQuery; i++)
+                validQuery = isValidQuery(
+                    TSFanoutCommand(command, task->fanout_targets[i]));
+        }
+    }
+    // вызов функции уже проверен в TSCallCommand
+    else if (!OidIsValid(func))
+        validQuery = isValidQuery(command);
+
     elog(DEBUG1, "pg_tkach_scheduler ts_schedule 6");
 
-    if (!isValidQuery(command))
+    if (!validQuery)
     {
         elog(LOG, "Invalid SQL command");
         PG_RETURN_INT64(-1);
@@ -244,6 +823,18 @@ ts_schedule(PG_FUNCTION_ARGS)
     task->note = note;
     task->username = username;
     task->database = database;
+    task->rate_group = rateGroup;
+    task->deferrable = deferrable;
+    task->idempotency_key = idempotencyKey;
+    task->func = func;
+    task->nargs = nargs;
+    task->args = args;
+    task->nsettings = nsettings;
+    task->settings = settings;
+    // в режиме deferred запрос проверит воркер перед первым выполнением,
+    // шаблон fan-out задачи без подстановки цели проверить нельзя
+    task->validated = OidIsValid(func) || TSFanoutTask(task) ||
+                      validation_mode != TS_VALIDATION_DEFERRED;
 
     elog(DEBUG1, "Type - %d", task->type);
 
@@ -277,11 +868,188 @@ ts_unschedule(PG_FUNCTION_ARGS)
 }
 
 
+/*
+ * ключ кеша результатов проверки SQL запросов
+ * результат полной проверки зависит от пользователя и search_path
+ */
+typedef struct ValidationCacheKey
+{
+    uint32 command_hash;
+    Oid userid;
+    uint32 search_path_hash;
+    int mode;
+} ValidationCacheKey;
+
+typedef struct ValidationCacheEntry
+{
+    ValidationCacheKey key;
+    char *command; // полный текст, чтобы не перепутать запросы с одним хешем
+} ValidationCacheEntry;
+
+// в кеше хранятся только успешные проверки
+static HTAB *validationCache = NULL;
+static MemoryContext validationCacheContext = NULL;
+static bool validationCacheCallbackRegistered = false;
+
+
+/*
+ * сбросить кеш проверок
+ * вызывается при любой инвалидации relcache, так как после изменения
+ * схемы ранее корректный запрос может стать некорректным
+ */
+static void
+InvalidateValidationCache(Datum arg, Oid relid)
+{
+    if (validationCacheContext != NULL)
+        MemoryContextReset(validationCacheContext);
+    validationCache = NULL;
+}
+
+
+/*
+ * сбросить кеш проверок при изменении функций, типов, операторов и схем:
+ * CREATE OR REPLACE и DROP FUNCTION не меняют relcache, но запрос,
+ * который их использует, может стать некорректным
+ */
+static void
+InvalidateValidationCacheSyscache(Datum arg, int cacheid, uint32 hashvalue)
+{
+    InvalidateValidationCache(arg, InvalidOid);
+}
+
+
+static void
+MakeValidationCacheKey(ValidationCacheKey *key, const char *sql)
+{
+    memset(key, 0, sizeof(ValidationCacheKey));
+    key->command_hash = hash_bytes((const unsigned char *)sql, strlen(sql));
+    key->userid = GetUserId();
+    key->search_path_hash =
+        hash_bytes((const unsigned char *)namespace_search_path,
+                   strlen(namespace_search_path));
+    key->mode = validation_mode;
+}
+
+
+static bool
+ValidationCacheLookup(ValidationCacheKey *key, const char *sql)
+{
+    if (validationCache == NULL)
+        return false;
+
+    ValidationCacheEntry *entry =
+        hash_search(validationCache, key, HASH_FIND, NULL);
+
+    return entry != NULL && strcmp(entry->command, sql) == 0;
+}
+
+
+static void
+ValidationCacheRemember(ValidationCacheKey *key, const char *sql)
+{
+    if (!validationCacheCallbackRegistered)
+    {
+        CacheRegisterRelcacheCallback(InvalidateValidationCache, (Datum)0);
+        CacheRegisterSyscacheCallback(
+            PROCOID, InvalidateValidationCacheSyscache, (Datum)0);
+        CacheRegisterSyscacheCallback(
+            TYPEOID, InvalidateValidationCacheSyscache, (Datum)0);
+        CacheRegisterSyscacheCallback(
+            OPEROID, InvalidateValidationCacheSyscache, (Datum)0);
+        CacheRegisterSyscacheCallback(
+            NAMESPACEOID, InvalidateValidationCacheSyscache, (Datum)0);
+        validationCacheCallbackRegistered = true;
+    }
+
+    if (validationCacheContext == NULL)
+        validationCacheContext =
+            AllocSetContextCreate(TopMemoryContext,
+                                  "pg_tkach_scheduler validation cache",
+                                  ALLOCSET_DEFAULT_SIZES);
+
+    // кеш не должен расти бесконечно
+    if (validationCache != NULL &&
+        hash_get_num_entries(validationCache) >= VALIDATION_CACHE_SIZE)
+        InvalidateValidationCache((Datum)0, InvalidOid);
+
+    if (validationCache == NULL)
+    {
+        HASHCTL ctl;
+        ctl.keysize = sizeof(ValidationCacheKey);
+        ctl.entrysize = sizeof(ValidationCacheEntry);
+        ctl.hcxt = validationCacheContext;
+        validationCache = hash_create("pg_tkach_scheduler validation cache",
+                                      256,
+                                      &ctl,
+                                      HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    bool found;
+    ValidationCacheEntry *entry =
+        hash_search(validationCache, key, HASH_ENTER, &found);
+
+    // при совпадении хешей запоминается последний запрос
+    if (found)
+        pfree(entry->command);
+    entry->command = MemoryContextStrdup(validationCacheContext, sql);
+}
+
+
 /*
  * функция для проверки корректности SQL запроса 
+ * что именно проверяется, определяет pg_tkach_scheduler.validation:
+ * full - полный разбор и планирование запроса,
+ * parse - только синтаксис, без обращения к каталогу,
+ * deferred - проверка откладывается до первого выполнения задачи
  */
 static bool
 isValidQuery(const char *sql)
+{
+    if (validation_mode == TS_VALIDATION_DEFERRED)
+        return true;
+
+    ValidationCacheKey key;
+    MakeValidationCacheKey(&key, sql);
+
+    if (ValidationCacheLookup(&key, sql))
+    {
+        elog(DEBUG1, "pg_tkach_scheduler isValidQuery cached");
+        return true;
+    }
+
+    bool result;
+    if (validation_mode == TS_VALIDATION_PARSE)
+        result = isValidQuerySyntax(sql);
+    else
+        result = isValidQueryPlan(sql);
+
+    if (result)
+        ValidationCacheRemember(&key, sql);
+
+    return result;
+}
+
+
+/*
+ * проверить только синтаксис запроса
+ * синтаксическая ошибка приводит к ERROR, как и при полной проверке
+ */
+static bool
+isValidQuerySyntax(const char *sql)
+{
+    List *parsetree = raw_parser(sql, RAW_PARSE_DEFAULT);
+    bool result = parsetree != NIL;
+
+    list_free_deep(parsetree);
+    return result;
+}
+
+
+/*
+ * полная проверка запроса через SPI_prepare
+ */
+static bool
+isValidQueryPlan(const char *sql)
 {
     int ret;
     bool result = false;
@@ -310,4 +1078,4 @@ isValidQuery(const char *sql)
     elog(DEBUG1, "pg_tkach_scheduler isValidQuery 5");
 
     return result;
-}
\ No newline at end of file
+}
@@ -20,6 +20,8 @@ CStringToTaskType(const char *type)
         return RepeatLimit;
     else if (strcmp(type, "repeat_until") == 0)
         return RepeatUntil;
+    else if (strcmp(type, "batch") == 0)
+        return Batch;
     else
         return Single; // на всякий случай
 
@@ -43,6 +45,8 @@ TaskTypeToCString(TaskType type)
         return "repeat_limit";
     case RepeatUntil:
         return "repeat_until";
+    case Batch:
+        return "batch";
     default:
         return "ERROR";
     }
@@ -65,6 +69,8 @@ Int32ToTaskType(int32 typeInt32)
         return RepeatLimit;
     case 3:
         return RepeatUntil;
+    case 4:
+        return Batch;
     }
 }
 
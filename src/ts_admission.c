@@ -0,0 +1,118 @@
+/* src/ts_admission.c */
+
+#include "postgres.h"
+#include "miscadmin.h"
+
+#include "access/xlog.h"
+#include "replication/walsender.h"
+#include "replication/walsender_private.h"
+#include "storage/proc.h"
+#include "storage/spin.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
+
+#include "ts_admission.h"
+
+// пороги нагрузки, 0 (false) - сигнал не учитывается
+int admission_max_active_backends = 0;
+int admission_max_lock_waits = 0;
+bool admission_defer_on_checkpoint = false;
+int admission_max_replication_lag = 0; // в килобайтах
+
+// на сколько секунд после своего времени может быть отложена задача
+int admission_max_delay = 300;
+
+
+/*
+ * отставание самой медленной реплики в байтах
+ */
+static int64
+GetReplicationLag(void)
+{
+    XLogRecPtr writePtr = GetXLogWriteRecPtr();
+    int64 lag = 0;
+
+    if (WalSndCtl == NULL)
+        return 0;
+
+    for (int i = 0; i < max_wal_senders; i++)
+    {
+        WalSnd *walsnd = &WalSndCtl->walsnds[i];
+
+        SpinLockAcquire(&walsnd->mutex);
+        pid_t pid = walsnd->pid;
+        XLogRecPtr flush = walsnd->flush;
+        SpinLockRelease(&walsnd->mutex);
+
+        if (pid == 0 || XLogRecPtrIsInvalid(flush) || flush > writePtr)
+            continue;
+
+        lag = Max(lag, (int64)(writePtr - flush));
+    }
+
+    return lag;
+}
+
+
+/*
+ * замерить нагрузку и решить, перегружен ли сервер
+ * сигналы читаются из PGPROC без блокировок: для решения о том, отложить ли
+ * задачу, достаточно приблизительных значений, зато замер стоит микросекунды
+ * значения сигналов записываются в stats
+ */
+bool
+TSAdmissionCheck(TSStats *stats)
+{
+    TimestampTz start = GetCurrentTimestamp();
+
+    int activeBackends = 0;
+    int lockWaits = 0;
+    bool checkpointInProgress = false;
+    Latch *checkpointerLatch = ProcGlobal->checkpointerLatch;
+
+    for (uint32 i = 0; i < ProcGlobal->allProcCount; i++)
+    {
+        PGPROC *proc = &ProcGlobal->allProcs[i];
+
+        if (proc->pid == 0 || proc == MyProc)
+            continue;
+
+        uint32 waitEvent = UINT32_ACCESS_ONCE(proc->wait_event_info);
+        uint32 waitClass = waitEvent & 0xFF000000;
+
+        // между контрольными точками checkpointer ждет в своем главном
+        // цикле; любое другое его состояние - запись буферов, паузы
+        // растянутой записи, fsync файлов - значит, что точка идет
+        if (&proc->procLatch == checkpointerLatch &&
+            waitEvent != WAIT_EVENT_CHECKPOINTER_MAIN)
+            checkpointInProgress = true;
+
+        if (waitClass == PG_WAIT_LOCK)
+            lockWaits++;
+
+        // простаивающие процессы ждут клиента, таймер или событие
+        // своего главного цикла, остальные заняты работой
+        if (waitClass != PG_WAIT_CLIENT && waitClass != PG_WAIT_ACTIVITY &&
+            waitClass != PG_WAIT_EXTENSION && waitClass != PG_WAIT_TIMEOUT)
+            activeBackends++;
+    }
+
+    stats->active_backends = activeBackends;
+    stats->lock_waits = lockWaits;
+    stats->checkpoint_in_progress = checkpointInProgress;
+    stats->replication_lag =
+        admission_max_replication_lag > 0 ? GetReplicationLag() : 0;
+
+    bool overloaded =
+        (admission_max_active_backends > 0 &&
+         activeBackends > admission_max_active_backends) ||
+        (admission_max_lock_waits > 0 &&
+         lockWaits > admission_max_lock_waits) ||
+        (admission_defer_on_checkpoint && checkpointInProgress) ||
+        (admission_max_replication_lag > 0 &&
+         stats->replication_lag > (int64)admission_max_replication_lag * 1024);
+
+    stats->admission_check_us = GetCurrentTimestamp() - start;
+
+    return overloaded;
+}
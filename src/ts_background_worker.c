@@ -3,30 +3,107 @@
 #include "c.h"
 #include "postgres.h"
 #include "fmgr.h"
+#include "miscadmin.h"
 
+#include <ctype.h>
+#include <sys/resource.h>
+
+#include "access/xact.h"
+#include "common/hashfn.h"
 #include "catalog/pg_type_d.h"
 #include "datatype/timestamp.h"
+#include "executor/instrument.h"
 #include "nodes/pg_list.h"
 #include "postmaster/bgworker.h"
 #include "pgstat.h"
+#include "storage/latch.h"
 #include "storage/proc.h"
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/elog.h"
 #include "utils/fmgrprotos.h"
+#include "utils/hsearch.h"
 #include "utils/memutils.h"
 #include "utils/palloc.h"
+#include "utils/timeout.h"
 #include "utils/timestamp.h"
 #include "executor/spi.h"
 #include "utils/ps_status.h"
+#include "utils/resowner.h"
+#include "postmaster/interrupt.h"
+#include "utils/guc.h"
+#include "parser/analyze.h"
+#include "parser/parser.h"
+#include "tcop/pquery.h"
+#include "tcop/tcopprot.h"
+#include "tcop/utility.h"
+#include "utils/portal.h"
 
 #include "task.h"
 #include "ts_background_worker.h"
-
-int task_check_interval = 10;
+#include "ts_admission.h"
+#include "ts_call.h"
+#include "ts_clock.h"
+#include "ts_executor.h"
+#include "ts_fanout.h"
+#include "ts_metrics.h"
+#include "ts_queue.h"
+#include "ts_rate_limit.h"
+#include "ts_settings.h"
+#include "ts_snapshot.h"
+#include "ts_stats.h"
+#include "ts_task_usage.h"
+
+int task_check_interval = 10;   // с
+int task_check_interval_ms = 0; // мс, 0 - используется task_check_interval
+int num_shards = 1;
+int batch_chunk_pause = 100;
+int batch_max_chunks_per_tick = 100;
+int batch_max_wal_rate = 0;
+int batch_retry_delay = 60; // с
+
+// адаптивная частота проверки: под нагрузкой итерации идут чаще,
+// выборки ограничены так, чтобы итерация укладывалась в tick_time_budget
+bool adaptive_tick = true;
+int min_check_interval = 10; // мс
+int tick_time_budget = 1000; // мс
+
+// сглаженная стоимость одной задачи и одной задачи очереди, мкс
+static double taskCostEwma = 0;
+static double jobCostEwma = 0;
+
+// номер шарда, задачи которого выполняет этот воркер
+static int shardId = 0;
 
 /* TODO: сделать изменение базы данных */
 char *TSTableName = "postgres"; // база данных с которой работаем по-умолчанию
 static volatile sig_atomic_t isSigTerm = false;
 
+// статистика текущей итерации главного цикла
+static TSStats tickStats;
+
+// транзакций воркера с начала итерации, считает CountTransaction
+static int64 tickTransactions = 0;
+
+// контекст памяти текущей итерации главного цикла, в нём живет список задач
+static MemoryContext tickContext = NULL;
+
+// ближайшее время повтора задач, отложенных на этой итерации
+static TimestampTz nextRetryTime = DT_NOEND;
+
+// объединять ли одинаковые задачи, которые нужно выполнить одновременно
+bool coalesce_tasks = false;
+
+
+/*
+ * задачи одной итерации с одинаковым хешем команды
+ */
+typedef struct CoalesceEntry
+{
+    uint32 command_hash; // ключ
+    List *tasks;
+} CoalesceEntry;
+
 PGDLLEXPORT void TSMain(Datum arg);
 
 
@@ -58,6 +135,7 @@ TSMain(Datum arg)
     elog(DEBUG1, "start TSMain pg_tkach_scheduler");
 
     pqsignal(SIGTERM, handleSigterm);
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
     BackgroundWorkerUnblockSignals();
     set_ps_display("pg_tkach_scheduler: initializing");
 
@@ -67,8 +145,33 @@ TSMain(Datum arg)
     // это чтобы pg_stat_ativity мог распознать worker-а
     pgstat_report_appname("pg_tkach_scheduler");
 
+    shardId = DatumGetInt32(arg);
+
+    // индекс по шардам поддерживает только один воркер,
+    // чтобы воркеры не мешали друг другу выполнять DDL
+    if (shardId == 0)
+        EnsureShardIndex();
+
     elog(DEBUG1, "pg_tkach_scheduler started");
 
+    TSClockRegisterWorker(shardId);
+
+    RegisterXactCallback(CountTransaction, NULL);
+
+    // снимок с прошлого запуска: первая итерация выбирает ближайшие
+    // задачи по первичному ключу, не просматривая всё расписание
+    TSWorkerState state;
+    ArrayType *warmTaskIds = TSSnapshotLoad(shardId, &state);
+    if (warmTaskIds != NULL)
+    {
+        taskCostEwma = state.task_cost;
+        jobCostEwma = state.job_cost;
+        TSQueueRestoreWatermark(shardId, state.queue_watermark);
+    }
+    TimestampTz lastSnapshot = GetCurrentTimestamp();
+    TimestampTz lastMetrics = 0;
+
+    TimestampTz deadline = TSNow();
 
     while (!isSigTerm)
     {
@@ -77,16 +180,41 @@ TSMain(Datum arg)
         //MemoryContextSwitchTo(TSMainLoopContext);
         CHECK_FOR_INTERRUPTS();
 
-        StartTransactionCommand();
+        // перечитать конфигурацию, например пороги контроля нагрузки
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
 
+        // контекст запоминается до начала транзакции,
+        // иначе это был бы контекст транзакции, удаляемый при commit
         MemoryContext caller_ctx = CurrentMemoryContext;
+
+        StartTransactionCommand();
+
         MemoryContext sched_ctx =
             AllocSetContextCreate(TopMemoryContext,
                                   "pg_tkach_scheduler context",
                                   ALLOCSET_DEFAULT_SIZES);
+        tickContext = sched_ctx;
         MemoryContextSwitchTo(sched_ctx);
 
-        List *taskList = GetCurrentTaskList(GetCurrentTimestamp());
+        // время планировщика, в режиме виртуального времени оно
+        // двигается только функциями ts.set_virtual_time и ts.advance_time
+        TimestampTz now = TSNow();
+        TimestampTz tickStart = GetCurrentTimestamp();
+        int64 tickLag = now - deadline;
+        int taskLimit = BatchSizeForBudget(taskCostEwma, TS_MAX_TASK_BATCH);
+        List *taskList = GetCurrentTaskList(now, taskLimit, warmTaskIds);
+
+        // задачи не из снимка выберет следующая обычная итерация
+        bool taskBacklog = list_length(taskList) >= taskLimit;
+        if (warmTaskIds != NULL)
+        {
+            pfree(warmTaskIds);
+            warmTaskIds = NULL;
+        }
 
         CommitTransactionCommand();
 
@@ -94,30 +222,408 @@ TSMain(Datum arg)
 
         elog(DEBUG1, "List length3: %d", list_length(taskList));
 
+        memset(&tickStats, 0, sizeof(TSStats));
+        tickStats.ticks = 1;
+        tickStats.tick_lag_us = tickLag;
+        tickStats.due_tasks = list_length(taskList);
+
+        // замер нагрузки стоит микросекунды, поэтому делается на каждой итерации
+        bool overloaded = TSAdmissionCheck(&tickStats);
+        if (overloaded)
+            tickStats.overloaded_ticks = 1;
+
+        nextRetryTime = DT_NOEND;
         if (taskList != NIL)
         {
-            ExecuteAllTask(taskList);
-            UpdateTaskStatus(taskList);
+            TimestampTz execStart = GetCurrentTimestamp();
+            ExecuteAllTask(taskList, now, overloaded);
+            UpdateTaskStatus(taskList, now);
+            UpdateCostEwma(&taskCostEwma,
+                           GetCurrentTimestamp() - execStart,
+                           list_length(taskList));
         }
         freeTaskList(taskList);
         MemoryContextDelete(sched_ctx);
 
-        pg_usleep(task_check_interval * 1000000L);
+        // разовые задачи из очереди ts.queue
+        int queueLimit = BatchSizeForBudget(jobCostEwma, queue_batch_size);
+        int64 queueJobs = tickStats.queue_jobs;
+        TimestampTz queueStart = GetCurrentTimestamp();
+        bool queueBacklog =
+            TSQueueProcess(now, shardId, queueLimit, &tickStats);
+        UpdateCostEwma(&jobCostEwma,
+                       GetCurrentTimestamp() - queueStart,
+                       tickStats.queue_jobs - queueJobs);
+
+        // секции очереди обслуживает только один воркер
+        if (shardId == 0)
+            TSQueueMaintain(now);
+
+        // следующая итерация начинается в заданный момент, а не через
+        // task_check_interval после конца этой, поэтому время выполнения
+        // задач не сдвигает расписание итераций
+        TimestampTz tickEnd = TSNow();
+        TimestampTz nextTick;
+        if (adaptive_tick)
+            nextTick = AdaptiveTickDeadline(tickEnd, taskBacklog || queueBacklog);
+        else if (taskBacklog || queueBacklog)
+            nextTick = tickEnd; // выбрано не всё, продолжаем сразу
+        else
+            nextTick = NextTickDeadline(tickEnd);
+
+        tickStats.tick_us = GetCurrentTimestamp() - tickStart;
+        tickStats.tick_interval_ms = Max(nextTick - tickEnd, 0) / 1000;
+        tickStats.batch_size = taskLimit;
+        tickStats.queue_batch_size = queueLimit;
+        tickStats.transactions = tickTransactions;
+        tickTransactions = 0;
+        TSHistogramObserve(&tickStats.tick_duration,
+                           (double)tickStats.tick_us / 1000.0);
+        TSStatsReport(shardId, &tickStats);
+
+        // файл метрик пишет только один воркер, статистика у них общая
+        if (shardId == 0 && metrics_file_interval > 0 &&
+            TimestampDifferenceExceeds(lastMetrics,
+                                       GetCurrentTimestamp(),
+                                       metrics_file_interval * 1000))
+        {
+            TSMetricsWriteFile();
+            lastMetrics = GetCurrentTimestamp();
+        }
+
+        if (snapshot_interval > 0 &&
+            TimestampDifferenceExceeds(lastSnapshot,
+                                       GetCurrentTimestamp(),
+                                       snapshot_interval * 1000))
+        {
+            WriteSnapshot(tickEnd, false);
+            lastSnapshot = GetCurrentTimestamp();
+        }
+
+        deadline = WaitForTick(nextTick);
 
         elog(DEBUG1, "pg_tkach_scheduler out TSMain loop");
     }
 
+    // при остановке снимок пишется всегда, чтобы запуск был быстрым
+    if (snapshot_interval > 0)
+        WriteSnapshot(TSNow(), true);
+
     //MemoryContextDelete(TSMainLoopContext);
     elog(DEBUG1, "pg_tkach_scheduler worker shutting down");
     //proc_exit(0);
 }
 
 
+/*
+ * посчитать завершённые транзакции воркера для статистики
+ */
+static void
+CountTransaction(XactEvent event, void *arg)
+{
+    if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT)
+        tickTransactions++;
+}
+
+
+/*
+ * сохранить снимок состояния воркера, shutdown - при остановке
+ */
+static void
+WriteSnapshot(TimestampTz now, bool shutdown)
+{
+    TSWorkerState state;
+
+    state.task_cost = taskCostEwma;
+    state.job_cost = jobCostEwma;
+    state.queue_watermark = TSQueueWatermark();
+
+    TSSnapshotWrite(shardId, &state, now, shutdown);
+}
+
+
+/*
+ * выражение, по которому задача относится к шарду
+ * в запросе и в индексе оно должно совпадать текстуально,
+ * поэтому число шардов подставляется константой
+ */
+char *
+ShardExpression(const char *column)
+{
+    return psprintf("((hashint8(%s) & 2147483647) %% %d)", column, num_shards);
+}
+
+
+/*
+ * выполнить один запрос sql в текущей транзакции как запрос верхнего
+ * уровня, через портал, а не через SPI, - так же, как запрос клиента
+ * (повторяет exec_simple_query)
+ * так выполняются команды, которым нужен верхний уровень: CALL процедуры
+ * с COMMIT и ROLLBACK и CREATE INDEX CONCURRENTLY; портал переживает
+ * фиксацию транзакции внутри запроса и восстанавливает контекст памяти
+ * и снимок, а перед вызовом не должно быть установленного снимка
+ * возвращает число обработанных строк
+ */
+static uint64
+RunTopLevelStatement(const char *sql)
+{
+    List *parsetreeList = pg_parse_query(sql);
+    if (list_length(parsetreeList) != 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_SYNTAX_ERROR),
+                 errmsg("pg_tkach_scheduler expects a single statement: %s",
+                        sql)));
+
+    RawStmt *parsetree = linitial_node(RawStmt, parsetreeList);
+
+    bool snapshotSet = false;
+    if (analyze_requires_snapshot(parsetree))
+    {
+        PushActiveSnapshot(GetTransactionSnapshot());
+        snapshotSet = true;
+    }
+
+#if PG_VERSION_NUM >= 150000
+    List *querytreeList =
+        pg_analyze_and_rewrite_fixedparams(parsetree, sql, NULL, 0, NULL);
+#else
+    List *querytreeList = pg_analyze_and_rewrite(parsetree, sql, NULL, 0, NULL);
+#endif
+    List *plantreeList =
+        pg_plan_queries(querytreeList, sql, CURSOR_OPT_PARALLEL_OK, NULL);
+
+    if (snapshotSet)
+        PopActiveSnapshot();
+
+    Portal portal = CreatePortal("", true, true);
+    portal->visible = false;
+    PortalDefineQuery(portal,
+                      NULL,
+                      sql,
+                      CreateCommandTag(parsetree->stmt),
+                      plantreeList,
+                      NULL);
+    PortalStart(portal, NULL, 0, InvalidSnapshot);
+
+    DestReceiver *receiver = CreateDestReceiver(DestNone);
+    QueryCompletion qc;
+    (void)PortalRun(portal, FETCH_ALL, true, true, receiver, receiver, &qc);
+    receiver->rDestroy(receiver);
+
+    PortalDrop(portal, false);
+
+    return qc.nprocessed;
+}
+
+
+/*
+ * выполнить команду, которую нельзя выполнить в блоке транзакции,
+ * например CREATE INDEX CONCURRENTLY, в своей транзакции
+ */
+static void
+ExecuteTopLevelUtility(const char *sql)
+{
+    StartTransactionCommand();
+    (void)RunTopLevelStatement(sql);
+    CommitTransactionCommand();
+}
+
+
+/*
+ * является ли команда задачи одним вызовом процедуры (CALL)
+ * текст разбирается, только если он начинается с CALL
+ */
+static bool
+IsCallCommand(const char *command)
+{
+    while (isspace((unsigned char)*command))
+        command++;
+
+    if (pg_strncasecmp(command, "call", 4) != 0 ||
+        !isspace((unsigned char)command[4]))
+        return false;
+
+    List *parsetreeList = raw_parser(command, RAW_PARSE_DEFAULT);
+    bool result = list_length(parsetreeList) == 1 &&
+                  IsA(linitial_node(RawStmt, parsetreeList)->stmt, CallStmt);
+
+    list_free_deep(parsetreeList);
+    return result;
+}
+
+
+/*
+ * имя и определение индекса расписания для текущего num_shards
+ * с одним шардом индекс только по time_next_exec
+ */
+static char *
+ShardIndexName(void)
+{
+    return psprintf("task_schedule_shard_%d_time_idx", num_shards);
+}
+
+static char *
+ShardIndexDef(void)
+{
+    if (num_shards > 1)
+        return psprintf("ts.task_schedule (%s, time_next_exec)",
+                        ShardExpression("task_id"));
+
+    return pstrdup("ts.task_schedule (time_next_exec)");
+}
+
+
+/*
+ * привести индекс расписания в соответствие с текущим num_shards
+ * обычно индекс создает скрипт расширения; если num_shards изменился
+ * или прошлое построение прервалось, воркер строит индекс сам через
+ * CREATE INDEX CONCURRENTLY, не блокируя запись в ts.task_schedule,
+ * и только потом удаляет индексы для старого числа шардов, так что
+ * таблица не остается без индекса
+ */
+static void
+EnsureShardIndex(void)
+{
+    elog(DEBUG1, "pg_tkach_scheduler start EnsureShardIndex");
+
+    char *indexName = ShardIndexName();
+    bool build = false;
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "failed to connect to SPI");
+
+    // расширение может быть еще не создано
+    if (SPI_execute("SELECT to_regclass('ts.task_schedule') IS NOT NULL",
+                    true,
+                    1) != SPI_OK_SELECT)
+        elog(ERROR, "SPI_exec failed while looking for ts.task_schedule");
+
+    bool isnull;
+    bool exists = DatumGetBool(SPI_getbinval(
+        SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+
+    if (exists)
+    {
+        Datum argValues[1];
+        Oid argTypes[1] = { TEXTOID };
+        argValues[0] = CStringGetTextDatum(indexName);
+
+        if (SPI_execute_with_args(
+                "SELECT i.indisvalid FROM pg_catalog.pg_index i "
+                "WHERE i.indexrelid = to_regclass('ts.' || $1)",
+                1,
+                argTypes,
+                argValues,
+                NULL,
+                true,
+                1) != SPI_OK_SELECT)
+            elog(ERROR, "SPI_exec failed while looking for shard index");
+
+        if (SPI_processed == 0)
+            build = true;
+        else if (!DatumGetBool(SPI_getbinval(
+                     SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull)))
+        {
+            // остался от прерванного CREATE INDEX CONCURRENTLY
+            char *dropSql = psprintf("DROP INDEX ts.%s", indexName);
+            elog(LOG, "pg_tkach_scheduler: %s", dropSql);
+            if (SPI_execute(dropSql, false, 0) != SPI_OK_UTILITY)
+                elog(ERROR, "SPI_exec failed witch drop shard index");
+            build = true;
+        }
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    if (!exists)
+        return;
+
+    if (build)
+    {
+        char *createSql = psprintf("CREATE INDEX CONCURRENTLY %s ON %s",
+                                   indexName,
+                                   ShardIndexDef());
+        MemoryContext oldcontext = CurrentMemoryContext;
+
+        elog(LOG, "pg_tkach_scheduler: %s", createSql);
+        set_ps_display("pg_tkach_scheduler: building shard index");
+
+        PG_TRY();
+        {
+            ExecuteTopLevelUtility(createSql);
+        }
+        PG_CATCH();
+        {
+            // без нового индекса старые не удаляются, а недостроенный
+            // индекс будет перестроен при следующем запуске
+            MemoryContextSwitchTo(oldcontext);
+            EmitErrorReport();
+            FlushErrorState();
+            AbortCurrentTransaction();
+
+            ereport(WARNING,
+                    (errmsg("pg_tkach_scheduler could not build shard index "
+                            "for num_shards = %d",
+                            num_shards),
+                     errhint("Run CREATE INDEX CONCURRENTLY %s ON %s;",
+                             indexName,
+                             ShardIndexDef())));
+            return;
+        }
+        PG_END_TRY();
+    }
+
+    // индексы для старого числа шардов, новый индекс уже есть
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "failed to connect to SPI");
+
+    Datum argValues[1];
+    Oid argTypes[1] = { TEXTOID };
+    argValues[0] = CStringGetTextDatum(indexName);
+
+    if (SPI_execute_with_args(
+            "SELECT format('DROP INDEX ts.%I', indexname) FROM pg_indexes "
+            "WHERE schemaname = 'ts' AND tablename = 'task_schedule' "
+            "AND indexname LIKE 'task\\_schedule\\_shard\\_%' "
+            "AND indexname <> $1",
+            1,
+            argTypes,
+            argValues,
+            NULL,
+            true,
+            0) != SPI_OK_SELECT)
+        elog(ERROR, "SPI_exec failed while looking for shard indexes");
+
+    SPITupleTable *tuptable = SPI_tuptable;
+    uint64 count = SPI_processed;
+
+    for (uint64 i = 0; i < count; i++)
+    {
+        char *dropSql = SPI_getvalue(tuptable->vals[i], tuptable->tupdesc, 1);
+        elog(LOG, "pg_tkach_scheduler: %s", dropSql);
+        if (SPI_execute(dropSql, false, 0) != SPI_OK_UTILITY)
+            elog(ERROR, "SPI_exec failed witch drop shard index");
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    elog(DEBUG1, "pg_tkach_scheduler end EnsureShardIndex");
+}
+
+
 /*
  * получить список задач, которые нужно сейчас выполнить по шаблону  расписания
  */
 static List *
-GetCurrentTaskList(TimestampTz time)
+GetCurrentTaskList(TimestampTz time, int limit, ArrayType *taskIds)
 {
     elog(DEBUG1, "pg_tkach_scheduler start GetCurrentTaskList");
 
@@ -137,19 +643,46 @@ GetCurrentTaskList(TimestampTz time)
                  errmsg("SPI connection failed")));
     }
 
-    // не произвожу выборку note, так как это поле не нужно для выполнения задачи
+    // выбираются все задачи, время которых уже наступило,
+    // так отложенная задача будет выбрана снова на следующей итерации
     const char *sql;
-    sql = "SELECT task_id, command, type, exec_interval, time_next_exec, "
-          "repeat_limit, until, username, database, note "
-          "FROM ts.task WHERE date_trunc('minute', time_next_exec) = "
-          "date_trunc('minute', $1);";
+    sql = "SELECT s.task_id, d.command, s.type, s.exec_interval, "
+          "s.time_next_exec, s.repeat_limit, s.until, d.username, d.database, "
+          "d.note, d.rate_group, r.tokens_per_second, r.burst, s.deferrable, "
+          "d.valid, d.func::OID, d.args, d.settings, d.fanout_parent::OID, "
+          "d.fanout_targets "
+          "FROM ts.task_schedule s JOIN ts.task_def d USING (task_id) "
+          "LEFT JOIN ts.rate_limit r ON r.group_name = d.rate_group "
+          "WHERE s.time_next_exec <= $1 AND d.valid IS NOT FALSE "
+          "AND (s.time_retry IS NULL OR s.time_retry <= $1)";
+
+    // воркер выбирает только задачи своего шарда,
+    // условие совпадает с выражением индекса из ShardIndexDef
+    if (num_shards > 1)
+        sql = psprintf(
+            "%s AND %s = %d", sql, ShardExpression("s.task_id"), shardId);
+
+    // задачи из снимка находятся по первичному ключу
+    if (taskIds != NULL)
+        sql = psprintf("%s AND s.task_id = ANY($3)", sql);
+
+    // самые просроченные задачи выбираются первыми
+    sql = psprintf("%s ORDER BY s.time_next_exec LIMIT $2", sql);
 
-    Datum argValues[1];
+    Datum argValues[3];
     argValues[0] = TimestampTzGetDatum(time);
-    Oid argTypes[1] = { TIMESTAMPTZOID };
-    char argNulls[1] = { ' ' };
-
-    ret = SPI_execute_with_args(sql, 1, argTypes, argValues, argNulls, true, 0);
+    argValues[1] = Int32GetDatum(limit);
+    argValues[2] = PointerGetDatum(taskIds);
+    Oid argTypes[3] = { TIMESTAMPTZOID, INT4OID, INT8ARRAYOID };
+    char argNulls[3] = { ' ', ' ', ' ' };
+
+    ret = SPI_execute_with_args(sql,
+                                taskIds != NULL ? 3 : 2,
+                                argTypes,
+                                argValues,
+                                argNulls,
+                                true,
+                                0);
 
     if (ret != SPI_OK_SELECT)
     {
@@ -206,6 +739,8 @@ GetTaskRecordFromTuple(SPITupleTable *tuptable, int index)
 
     task->command =
         pstrdup(TextDatumGetCString(SPI_getbinval(tuple, tupdesc, 2, &isnull)));
+    task->command_hash =
+        hash_bytes((const unsigned char *)task->command, strlen(task->command));
     elog(DEBUG1, "pg_tkach_scheduler start GetTaskRecordFromTuple 3");
 
     task->type = CStringToTaskType(DatumGetCString(DirectFunctionCall1(
@@ -267,6 +802,69 @@ GetTaskRecordFromTuple(SPITupleTable *tuptable, int index)
     task->database =
         pstrdup(TextDatumGetCString(SPI_getbinval(tuple, tupdesc, 9, &isnull)));
 
+    // группа ограничения частоты может быть NULL
+    task->rate_group = NULL;
+    task->rate = 0;
+    task->burst = 0;
+    task->deferred = false;
+    task->time_retry = 0;
+    task->queue_job = false;
+    task->batch_done = false;
+    task->failed = false;
+    task->exec_time = 0;
+    task->deferrable =
+        DatumGetBool(SPI_getbinval(tuple, tupdesc, 14, &isnull));
+
+    // valid IS NULL - запрос еще не проверялся
+    Datum validDatum = SPI_getbinval(tuple, tupdesc, 15, &isnull);
+    task->validated = !isnull && DatumGetBool(validDatum);
+
+    // задача в режиме вызова функции
+    task->func = InvalidOid;
+    task->nargs = 0;
+    task->args = NULL;
+    Datum funcDatum = SPI_getbinval(tuple, tupdesc, 16, &isnull);
+    if (!isnull)
+    {
+        task->func = DatumGetObjectId(funcDatum);
+
+        Datum argsDatum = SPI_getbinval(tuple, tupdesc, 17, &isnull);
+        if (!isnull)
+            TSCallArgsFromArray(
+                DatumGetArrayTypeP(argsDatum), &task->args, &task->nargs);
+    }
+
+    // настройки задачи могут быть NULL
+    task->nsettings = 0;
+    task->settings = NULL;
+    Datum settingsDatum = SPI_getbinval(tuple, tupdesc, 18, &isnull);
+    if (!isnull)
+        TSCallArgsFromArray(
+            DatumGetArrayTypeP(settingsDatum), &task->settings, &task->nsettings);
+
+    // цели fan-out задачи: секционированная таблица или список
+    task->fanout_parent = InvalidOid;
+    task->nfanout_targets = 0;
+    task->fanout_targets = NULL;
+    Datum parentDatum = SPI_getbinval(tuple, tupdesc, 19, &isnull);
+    if (!isnull)
+        task->fanout_parent = DatumGetObjectId(parentDatum);
+    Datum targetsDatum = SPI_getbinval(tuple, tupdesc, 20, &isnull);
+    if (!isnull)
+        TSCallArgsFromArray(DatumGetArrayTypeP(targetsDatum),
+                            &task->fanout_targets,
+                            &task->nfanout_targets);
+
+    Datum rateGroupDatum = SPI_getbinval(tuple, tupdesc, 11, &isnull);
+    if (!isnull)
+    {
+        task->rate_group = pstrdup(TextDatumGetCString(rateGroupDatum));
+        task->rate =
+            DatumGetFloat8(SPI_getbinval(tuple, tupdesc, 12, &isnull));
+        task->burst =
+            DatumGetFloat8(SPI_getbinval(tuple, tupdesc, 13, &isnull));
+    }
+
     elog(LOG, "pg_tkach_scheduler end GetTaskRecordFromTuple");
     return task;
 }
@@ -276,101 +874,1016 @@ GetTaskRecordFromTuple(SPITupleTable *tuptable, int index)
  * запустить задачи
  */
 static void
-ExecuteAllTask(List *taskList)
+ExecuteAllTask(List *taskList, TimestampTz now, bool overloaded)
 {
     elog(DEBUG1, "pg_tkach_scheduler start ExecuteAllTask");
     ListCell *cell; // = palloc(sizeof(ListCell));
 
     elog(DEBUG1, "List lenght: %d", list_length(taskList));
 
+    // выполненные на этой итерации задачи по хешу команды
+    HTAB *executed = NULL;
+    if (coalesce_tasks)
+    {
+        HASHCTL ctl;
+        ctl.keysize = sizeof(uint32);
+        ctl.entrysize = sizeof(CoalesceEntry);
+        ctl.hcxt = tickContext;
+        executed = hash_create("pg_tkach_scheduler executed tasks",
+                               list_length(taskList),
+                               &ctl,
+                               HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
     foreach (cell, taskList)
     {
         Task *task = (Task *)lfirst(cell);
-        StartTransactionCommand();
-        ExecuteTask(task);
-        CommitTransactionCommand();
+
+        // запрос задачи, запланированной в режиме validation = deferred,
+        // проверяется перед первым выполнением, некорректная задача
+        // помечается и больше не выбирается
+        if (!task->validated && !ValidateTaskCommand(task))
+        {
+            task->deferred = true;
+            tickStats.tasks_invalid++;
+            continue;
+        }
+
+        // такая же задача уже выполнилась на этой итерации,
+        // повторять её нет смысла, задача считается выполненной
+        if (executed != NULL && task->type != Batch && !TSFanoutTask(task))
+        {
+            Task *same = FindExecutedTask(executed, task);
+            if (same != NULL)
+            {
+                elog(DEBUG1,
+                     "pg_tkach_scheduler task %ld coalesced with task %ld",
+                     task->task_id,
+                     same->task_id);
+                task->exec_time = same->exec_time;
+                tickStats.tasks_coalesced++;
+                continue;
+            }
+        }
+
+        // пока сервер перегружен, задачи, которые можно откладывать,
+        // ждут, но не дольше admission_max_delay после своего времени
+        // проверяется до группы ограничения частоты, чтобы отложенная
+        // задача не тратила токен группы
+        if (overloaded && task->deferrable &&
+            now - task->time_next_exec <
+                (int64)admission_max_delay * USECS_PER_SEC)
+        {
+            elog(DEBUG1,
+                 "pg_tkach_scheduler task %ld deferred by admission control",
+                 task->task_id);
+            task->deferred = true;
+            task->time_retry =
+                Min(now + TaskCheckInterval(),
+                    task->time_next_exec +
+                        (int64)admission_max_delay * USECS_PER_SEC);
+            nextRetryTime = Min(nextRetryTime, task->time_retry);
+            tickStats.tasks_admission_deferred++;
+            continue;
+        }
+
+        // если в группе задачи закончились токены, задача откладывается
+        // до появления токена: её время не меняется, а time_retry не дает
+        // выбирать её раньше, чтобы отложенные задачи не занимали выборку
+        if (task->rate_group != NULL &&
+            !TSRateLimitAcquire(task->rate_group,
+                                task->rate,
+                                task->burst,
+                                TSNow(),
+                                &task->time_retry))
+        {
+            elog(DEBUG1,
+                 "pg_tkach_scheduler task %ld deferred by rate group %s",
+                 task->task_id,
+                 task->rate_group);
+            task->deferred = true;
+            nextRetryTime = Min(nextRetryTime, task->time_retry);
+            tickStats.tasks_rate_limited++;
+            continue;
+        }
+
+        tickStats.tasks_executed++;
+        TSHistogramObserve(&tickStats.dispatch_lag,
+                           (double)(TSNow() - task->time_next_exec) / 1000.0);
+
+        if (task->type == Batch)
+        {
+            ExecuteBatchTask(task);
+            TSHistogramObserve(&tickStats.exec_duration, task->exec_time);
+            continue;
+        }
+
+        TimestampTz startTime = GetCurrentTimestamp();
+
+        // в исполнителе задача выполняется от имени её владельца
+        // в её базе данных, ошибка задачи не останавливает воркер
+        if (TSFanoutTask(task))
+            task->failed = !TSFanoutRun(task, &tickStats);
+        else if (max_executors > 0)
+        {
+            uint64 processed;
+            if (!TSExecutorRun(task, &processed))
+            {
+                task->failed = true;
+                tickStats.tasks_failed++;
+            }
+        }
+        else
+        {
+            uint64 processed;
+            if (!ExecuteTaskInWorker(task, &processed))
+            {
+                task->failed = true;
+                tickStats.tasks_failed++;
+            }
+        }
+
+        task->exec_time =
+            (double)(GetCurrentTimestamp() - startTime) / 1000.0;
+        TSHistogramObserve(&tickStats.exec_duration, task->exec_time);
+
+        // с задачей, завершившейся ошибкой, не объединяем: её
+        // копии должны выполниться сами, а не разделить ошибку
+        if (executed != NULL && !task->failed && !TSFanoutTask(task))
+        {
+            bool found;
+            CoalesceEntry *entry =
+                hash_search(executed, &task->command_hash, HASH_ENTER, &found);
+
+            MemoryContext oldcontext = MemoryContextSwitchTo(tickContext);
+            entry->tasks = found ? lappend(entry->tasks, task) : list_make1(task);
+            MemoryContextSwitchTo(oldcontext);
+        }
     }
+
+    if (executed != NULL)
+        hash_destroy(executed);
+
     elog(DEBUG1, "pg_tkach_scheduler end ExecuteAllTask");
 }
 
 
 /*
- * выполнить одну задачу
+ * найти среди выполненных на этой итерации задачу с той же командой,
+ * пользователем и базой данных
  */
-static void
-ExecuteTask(Task *task)
+static Task *
+FindExecutedTask(HTAB *executed, Task *task)
 {
-    elog(DEBUG1, "pg_tkach_scheduler start ExecuteTask");
+    CoalesceEntry *entry =
+        hash_search(executed, &task->command_hash, HASH_FIND, NULL);
 
-    const char *command = task->command;
+    if (entry == NULL)
+        return NULL;
 
-    // TODO: тут наверняка должна быть логика подстановки database и username
-    int ret;
+    ListCell *cell;
+    foreach (cell, entry->tasks)
+    {
+        Task *same = (Task *)lfirst(cell);
 
-    PushActiveSnapshot(GetTransactionSnapshot());
+        if (strcmp(same->command, task->command) == 0 &&
+            strcmp(same->username, task->username) == 0 &&
+            strcmp(same->database, task->database) == 0 &&
+            SameTaskSettings(same, task))
+            return same;
+    }
+
+    return NULL;
+}
 
-    if ((ret = SPI_connect() != SPI_OK_CONNECT))
-        elog(ERROR, "failed to connect to SPI while getting current tasks");
 
-    ret = SPI_execute(command, false, 0);
+/*
+ * одинаковы ли настройки задач: команда с другими параметрами,
+ * например statement_timeout, может выполниться иначе
+ */
+static bool
+SameTaskSettings(Task *a, Task *b)
+{
+    if (a->nsettings != b->nsettings)
+        return false;
 
-    if (ret < 0)
+    for (int i = 0; i < a->nsettings; i++)
     {
-        ereport(WARNING,
-                (errcode(ERRCODE_INTERNAL_ERROR),
-                 errmsg("Task execution failed: %s", command),
-                 errdetail("SPI status: %d", ret)));
+        if (strcmp(a->settings[i], b->settings[i]) != 0)
+            return false;
     }
-    SPI_finish();
-    PopActiveSnapshot();
 
-    // восстанавливаем контекст памяти и удаляем временный контекст
-    elog(DEBUG1, "pg_tkach_scheduler end ExecuteTask");
+    return true;
 }
 
 
 /*
- * обновить время следующего выполнения задач
- * если задача больше никогда не выполнится, то она удалится
+ * проверить запрос задачи и сохранить результат в ts.task_def.valid
+ * запрос проверяется от имени владельца задачи: на его исполнителе,
+ * а без исполнителей - в воркере, сменив пользователя; ошибка разбора
+ * перехватывается, чтобы некорректная задача не останавливала воркер
  */
-static void
-UpdateTaskStatus(List *taskList)
+static bool
+ValidateTaskCommand(Task *task)
 {
-    elog(DEBUG1, "pg_tkach_scheduler start UpdateTaskStatus");
-    ListCell *cell;
+    elog(DEBUG1, "pg_tkach_scheduler start ValidateTaskCommand");
 
-    foreach (cell, taskList)
+    bool valid = true;
+
+    if (max_executors > 0)
     {
-        Task *task = (Task *)lfirst(cell);
+        // проверка не выполнилась, задача проверится на следующей итерации
+        if (!TSExecutorValidate(task, &valid))
+            return false;
 
-        switch (task->type)
-        {
-        case (Single):
-            DeleteTask(task->task_id);
-            break;
+        StartTransactionCommand();
+        PushActiveSnapshot(GetTransactionSnapshot());
+    }
+    else
+    {
+        StartTransactionCommand();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        valid = ValidateTaskCommandAsOwner(task);
+    }
 
-        case (Repeat):
-            TimestampTz newTimeNextExec = GetNewTimeNextExec(task);
-            UpdateTaskTimeNextExec(task->task_id, newTimeNextExec);
-            break;
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "failed to connect to SPI");
 
-        case (RepeatLimit):
-            int repeat_limit = task->repeat_limit;
-            repeat_limit--;
-            if (repeat_limit == 0)
+    Datum argValues[2];
+    Oid argTypes[2] = { INT8OID, BOOLOID };
+
+    argValues[0] = Int64GetDatum(task->task_id);
+    argValues[1] = BoolGetDatum(valid);
+
+    if (SPI_execute_with_args(
+            "UPDATE ts.task_def SET valid = $2 WHERE task_id = $1;",
+            2,
+            argTypes,
+            argValues,
+            NULL,
+            false,
+            1) != SPI_OK_UPDATE)
+        elog(ERROR, "SPI_exec failed witch update valid");
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    task->validated = valid;
+
+    if (!valid)
+        ereport(WARNING,
+                (errmsg("pg_tkach_scheduler task %ld is invalid and will "
+                        "not be executed",
+                        task->task_id),
+                 errhint("Fix the task or the objects it uses, then run "
+                         "UPDATE ts.task_def SET valid = NULL WHERE "
+                         "task_id = %ld to check it again.",
+                         task->task_id)));
+
+    elog(DEBUG1, "pg_tkach_scheduler end ValidateTaskCommand");
+    return valid;
+}
+
+
+/*
+ * проверить запрос задачи в воркере от имени её владельца
+ * ошибка разбора перехватывается во вложенной транзакции, которая
+ * при откате возвращает и пользователя воркера
+ */
+static bool
+ValidateTaskCommandAsOwner(Task *task)
+{
+    volatile bool valid = true;
+
+    Oid ownerId = get_role_oid(task->username, true);
+    if (!OidIsValid(ownerId))
+    {
+        ereport(WARNING,
+                (errmsg("pg_tkach_scheduler task %ld owner \"%s\" does "
+                        "not exist",
+                        task->task_id,
+                        task->username)));
+        return false;
+    }
+
+    Oid savedUserId;
+    int savedSecContext;
+    GetUserIdAndSecContext(&savedUserId, &savedSecContext);
+
+    MemoryContext txnContext = CurrentMemoryContext;
+    ResourceOwner txnOwner = CurrentResourceOwner;
+
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(txnContext);
+
+    PG_TRY();
+    {
+        SetUserIdAndSecContext(ownerId,
+                               savedSecContext | SECURITY_LOCAL_USERID_CHANGE);
+
+        if (SPI_connect() != SPI_OK_CONNECT)
+            elog(ERROR, "failed to connect to SPI");
+
+        SPIPlanPtr plan = SPI_prepare(task->command, 0, NULL);
+        if (plan == NULL)
+            valid = false;
+        else
+            SPI_freeplan(plan);
+
+        SPI_finish();
+
+        SetUserIdAndSecContext(savedUserId, savedSecContext);
+
+        ReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(txnContext);
+        CurrentResourceOwner = txnOwner;
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(txnContext);
+        ErrorData *edata = CopyErrorData();
+        FlushErrorState();
+
+        RollbackAndReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(txnContext);
+        CurrentResourceOwner = txnOwner;
+        SetUserIdAndSecContext(savedUserId, savedSecContext);
+
+        ereport(WARNING,
+                (errmsg("pg_tkach_scheduler task %ld is invalid: %s",
+                        task->task_id,
+                        edata->message)));
+        FreeErrorData(edata);
+        valid = false;
+    }
+    PG_END_TRY();
+
+    return valid;
+}
+
+
+/*
+ * разница между двумя моментами времени getrusage в миллисекундах
+ */
+static double
+TimevalDiffMs(const struct timeval *end, const struct timeval *start)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1000.0 +
+           (double)(end->tv_usec - start->tv_usec) / 1000.0;
+}
+
+
+/*
+ * учесть ресурсы выполнения задачи по разнице счетчиков процесса
+ * с момента, когда были сняты bufferStart, walStart и rusageStart
+ */
+static void
+ReportTaskUsage(Task *task,
+                const BufferUsage *bufferStart,
+                const WalUsage *walStart,
+                const struct rusage *rusageStart)
+{
+    BufferUsage bufferUsage;
+    WalUsage walUsage;
+    struct rusage rusageEnd;
+    getrusage(RUSAGE_SELF, &rusageEnd);
+
+    memset(&bufferUsage, 0, sizeof(BufferUsage));
+    BufferUsageAccumDiff(&bufferUsage, &pgBufferUsage, bufferStart);
+    memset(&walUsage, 0, sizeof(WalUsage));
+    WalUsageAccumDiff(&walUsage, &pgWalUsage, walStart);
+    task->wal_bytes = walUsage.wal_bytes;
+
+    // задач очереди слишком много, чтобы учитывать каждую отдельно
+    if (!task->queue_job)
+        TSTaskUsageReport(
+            task->task_id,
+            &bufferUsage,
+            &walUsage,
+            TimevalDiffMs(&rusageEnd.ru_utime, &rusageStart->ru_utime),
+            TimevalDiffMs(&rusageEnd.ru_stime, &rusageStart->ru_stime));
+}
+
+
+/*
+ * выполнить задачу в самом воркере (max_executors = 0) в отдельной
+ * транзакции от имени её владельца
+ * воркер подключен только к своей базе, задачи других баз не выполняются
+ * ошибка задачи перехватывается и не останавливает воркер
+ */
+bool
+ExecuteTaskInWorker(Task *task, uint64 *processed)
+{
+    volatile bool ok = true;
+
+    *processed = 0;
+
+    if (strcmp(task->database, TSTableName) != 0)
+    {
+        ereport(WARNING,
+                (errmsg("pg_tkach_scheduler task %ld in database \"%s\" "
+                        "cannot run without executors",
+                        task->task_id,
+                        task->database),
+                 errhint("Set pg_tkach_scheduler.max_executors above 0.")));
+        return false;
+    }
+
+    Oid savedUserId;
+    int savedSecContext;
+    GetUserIdAndSecContext(&savedUserId, &savedSecContext);
+
+    MemoryContext oldcontext = CurrentMemoryContext;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+
+    PG_TRY();
+    {
+        Oid ownerId = get_role_oid(task->username, true);
+        if (!OidIsValid(ownerId))
+            ereport(ERROR,
+                    (errcode(ERRCODE_UNDEFINED_OBJECT),
+                     errmsg("owner \"%s\" does not exist", task->username)));
+
+        SetUserIdAndSecContext(ownerId,
+                               savedSecContext | SECURITY_LOCAL_USERID_CHANGE);
+
+        *processed = ExecuteTask(task);
+
+        SetUserIdAndSecContext(savedUserId, savedSecContext);
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        SetUserIdAndSecContext(savedUserId, savedSecContext);
+        MemoryContextSwitchTo(oldcontext);
+        ErrorData *edata = CopyErrorData();
+        FlushErrorState();
+
+        // задача могла прерваться, не остановив таймер statement_timeout
+        disable_timeout(STATEMENT_TIMEOUT, false);
+        AbortCurrentTransaction();
+
+        ereport(WARNING,
+                (errmsg("pg_tkach_scheduler task %ld failed: %s",
+                        task->task_id,
+                        edata->message)));
+        FreeErrorData(edata);
+        ok = false;
+    }
+    PG_END_TRY();
+
+    MemoryContextSwitchTo(oldcontext);
+
+    return ok;
+}
+
+
+/*
+ * выполнить одну задачу в текущей транзакции
+ * вызывается воркером или исполнителем задачи
+ */
+uint64
+ExecuteTask(Task *task)
+{
+    elog(DEBUG1, "pg_tkach_scheduler start ExecuteTask");
+
+    const char *command = task->command;
+
+    int ret;
+    uint64 processed = 0;
+
+    // процедура может фиксировать транзакцию задачи (COMMIT и ROLLBACK),
+    // поэтому выполняется через CALL как запрос верхнего уровня, без SPI
+    // и без установленного снимка
+    bool isProcedure = OidIsValid(task->func) ? TSCallIsProcedure(task)
+                                              : IsCallCommand(command);
+
+    if (!isProcedure)
+    {
+        PushActiveSnapshot(GetTransactionSnapshot());
+
+        if ((ret = SPI_connect() != SPI_OK_CONNECT))
+            elog(ERROR, "failed to connect to SPI while getting current tasks");
+    }
+
+    // настройки задачи действуют до конца её транзакции
+    // (у процедуры - до её первого COMMIT или ROLLBACK)
+    TSSettingsApply(task->settings, task->nsettings);
+
+    // ресурсы выполнения считаем по разнице счетчиков процесса
+    BufferUsage bufferStart = pgBufferUsage;
+    WalUsage walStart = pgWalUsage;
+    struct rusage rusageStart;
+    getrusage(RUSAGE_SELF, &rusageStart);
+
+    // обычный бэкенд запускает таймер statement_timeout на каждый запрос
+    // клиента, а SPI - нет, поэтому для задачи он запускается здесь
+    if (StatementTimeout > 0)
+        enable_timeout_after(STATEMENT_TIMEOUT, StatementTimeout);
+
+    PG_TRY();
+    {
+        // функция вызывается напрямую, без разбора и планирования запроса,
+        // процедуры выполняются через CALL из command
+        if (isProcedure)
+            processed = RunTopLevelStatement(command);
+        else if (!OidIsValid(task->func) || !TSCallExecute(task, &processed))
+        {
+            ret = SPI_execute(command, false, 0);
+
+            if (ret < 0)
+            {
+                ereport(WARNING,
+                        (errcode(ERRCODE_INTERNAL_ERROR),
+                         errmsg("Task execution failed: %s", command),
+                         errdetail("SPI status: %d", ret)));
+            }
+            else
+                processed = SPI_processed;
+        }
+    }
+    PG_CATCH();
+    {
+        // ресурсы задачи, завершившейся ошибкой, интересны не меньше
+        disable_timeout(STATEMENT_TIMEOUT, false);
+        ReportTaskUsage(task, &bufferStart, &walStart, &rusageStart);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    disable_timeout(STATEMENT_TIMEOUT, false);
+    ReportTaskUsage(task, &bufferStart, &walStart, &rusageStart);
+
+    if (!isProcedure)
+    {
+        SPI_finish();
+        PopActiveSnapshot();
+    }
+
+    // восстанавливаем контекст памяти и удаляем временный контекст
+    elog(DEBUG1, "pg_tkach_scheduler end ExecuteTask");
+    return processed;
+}
+
+
+/*
+ * размер выборки, которую при стоимости одной задачи costUs можно
+ * выполнить за tick_time_budget, но не больше maxBatch
+ */
+static int
+BatchSizeForBudget(double costUs, int maxBatch)
+{
+    if (!adaptive_tick || costUs <= 0)
+        return maxBatch;
+
+    double batch = (double)tick_time_budget * 1000.0 / costUs;
+
+    return (int)Max(Min(batch, (double)maxBatch), (double)TS_MIN_BATCH);
+}
+
+
+/*
+ * учесть стоимость count задач, выполненных за elapsedUs
+ */
+static void
+UpdateCostEwma(double *ewma, int64 elapsedUs, int64 count)
+{
+    if (count <= 0)
+        return;
+
+    double cost = (double)elapsedUs / (double)count;
+
+    if (*ewma <= 0)
+        *ewma = cost;
+    else
+        *ewma = TS_COST_EWMA_ALPHA * cost + (1.0 - TS_COST_EWMA_ALPHA) * *ewma;
+}
+
+
+/*
+ * ближайшее время выполнения задачи или задачи очереди своего шарда
+ * после now, но раньше until, DT_NOEND, если таких нет
+ * дальше until воркер все равно не ждет, поэтому просматривается только
+ * начало индекса по времени, а не всё расписание
+ * задачи, отложенные этой итерацией, учитываются через nextRetryTime
+ */
+static TimestampTz
+GetNextDueTime(TimestampTz now, TimestampTz until)
+{
+    TimestampTz nextDue = DT_NOEND;
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "failed to connect to SPI");
+
+    const char *taskSql;
+    const char *jobSql;
+    taskSql = "SELECT time_next_exec FROM ts.task_schedule "
+              "WHERE time_next_exec > $1 AND time_next_exec < $2";
+    jobSql = "SELECT time_exec FROM ts.queue "
+             "WHERE time_exec > $1 AND time_exec < $2";
+
+    if (num_shards > 1)
+    {
+        taskSql = psprintf(
+            "%s AND %s = %d", taskSql, ShardExpression("task_id"), shardId);
+        jobSql = psprintf(
+            "%s AND %s = %d", jobSql, ShardExpression("job_id"), shardId);
+    }
+
+    const char *sql = psprintf("SELECT least((%s ORDER BY 1 LIMIT 1), "
+                               "(%s ORDER BY 1 LIMIT 1));",
+                               taskSql,
+                               jobSql);
+
+    Datum argValues[2];
+    Oid argTypes[2] = { TIMESTAMPTZOID, TIMESTAMPTZOID };
+    argValues[0] = TimestampTzGetDatum(now);
+    argValues[1] = TimestampTzGetDatum(until);
+
+    if (SPI_execute_with_args(sql, 2, argTypes, argValues, NULL, true, 1) !=
+        SPI_OK_SELECT)
+        elog(ERROR, "SPI_exec failed while getting next due time");
+
+    bool isnull;
+    Datum nextDatum = SPI_getbinval(
+        SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+    if (!isnull)
+        nextDue = DatumGetTimestampTz(nextDatum);
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    return nextDue;
+}
+
+
+/*
+ * момент следующей итерации в адаптивном режиме
+ * пока задачи не помещаются в выборку, итерации идут через
+ * min_check_interval, иначе воркер ждет до ближайшей задачи,
+ * но не дольше обычной проверки через task_check_interval
+ */
+static TimestampTz
+AdaptiveTickDeadline(TimestampTz now, bool backlog)
+{
+    TimestampTz minNext = now + (int64)min_check_interval * 1000;
+
+    if (backlog)
+        return minNext;
+
+    TimestampTz regular = NextTickDeadline(now);
+    TimestampTz nextDue = Min(GetNextDueTime(now, regular), nextRetryTime);
+
+    if (nextDue < regular)
+        return Max(nextDue, minNext);
+
+    return regular;
+}
+
+
+/*
+ * момент следующей итерации: ближайшее после now время, кратное
+ * task_check_interval, итерации, пропущенные из-за долгого выполнения
+ * задач, не наверстываются
+ */
+static TimestampTz
+NextTickDeadline(TimestampTz now)
+{
+    int64 interval = TaskCheckInterval();
+
+    return (now / interval + 1) * interval;
+}
+
+
+/*
+ * интервал проверки задач в микросекундах
+ * task_check_interval задается в секундах, как в версии 1.0, а
+ * task_check_interval_ms, если задан, уточняет его до миллисекунд
+ */
+static int64
+TaskCheckInterval(void)
+{
+    if (task_check_interval_ms > 0)
+        return (int64)Max(task_check_interval_ms, 10) * 1000;
+
+    return (int64)task_check_interval * USECS_PER_SEC;
+}
+
+
+/*
+ * ждать до момента deadline по времени планировщика
+ * латч может разбудить воркер раньше, тогда ожидание продолжается
+ * возвращает момент, до которого воркер ждал на самом деле
+ */
+static TimestampTz
+WaitForTick(TimestampTz deadline)
+{
+    while (!isSigTerm)
+    {
+        // перечитать конфигурацию, пока воркер ждет
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        TimestampTz now = TSNow();
+        if (now >= deadline)
+            break;
+
+        // срок дальше одного интервала бывает после уменьшения
+        // task_check_interval или возврата от виртуального времени к реальному
+        if (deadline - now > TaskCheckInterval())
+        {
+            deadline = NextTickDeadline(now);
+            continue;
+        }
+
+        // ts.advance_time ждет, пока все воркеры дойдут до нового времени
+        TSClockReportSeen(shardId, now);
+
+        // виртуальное время стоит, пока его не сдвинут, сдвиг будит воркер
+        WorkerSleep(TSClockIsVirtual()
+                        ? 1000
+                        : TimestampDifferenceMilliseconds(now, deadline));
+    }
+
+    return deadline;
+}
+
+
+/*
+ * подождать ms миллисекунд, просыпаясь по сигналу
+ */
+static void
+WorkerSleep(long ms)
+{
+    (void)WaitLatch(MyLatch,
+                    WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                    ms,
+                    PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+    CHECK_FOR_INTERRUPTS();
+}
+
+
+/*
+ * сохранить прогресс задачи batch
+ * вызывается в транзакции пачки, поэтому прогресс фиксируется
+ * вместе с её изменениями и переживает перезапуск воркера
+ * (пачку, выполненную исполнителем, воркер отмечает сразу после неё)
+ */
+static void
+UpdateBatchProgress(int64 taskId, uint64 processed, double execTime)
+{
+    PushActiveSnapshot(GetTransactionSnapshot());
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "failed to connect to SPI");
+
+    const char *sql;
+    sql = "UPDATE ts.task_schedule SET exec_count = exec_count + 1, "
+          "time_retry = NULL, last_run_ok = true, "
+          "rows_processed = rows_processed + $2, "
+          "exec_time_total = exec_time_total + $3 WHERE task_id = $1;";
+
+    Datum argValues[3];
+    Oid argTypes[3] = {
+        INT8OID,
+        INT8OID,
+        FLOAT8OID,
+    };
+
+    argValues[0] = Int64GetDatum(taskId);
+    argValues[1] = Int64GetDatum((int64)processed);
+    argValues[2] = Float8GetDatum(execTime);
+
+    if (SPI_execute_with_args(sql, 3, argTypes, argValues, NULL, false, 1) !=
+        SPI_OK_UPDATE)
+        elog(ERROR, "SPI_exec failed witch update batch progress");
+
+    SPI_finish();
+    PopActiveSnapshot();
+}
+
+
+/*
+ * отметить, что пачка задачи batch завершилась ошибкой
+ * задача продолжится не раньше retryAt, чтобы ошибка не повторялась
+ * на каждой итерации
+ */
+static void
+UpdateBatchFailure(int64 taskId, TimestampTz retryAt)
+{
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "failed to connect to SPI");
+
+    const char *sql;
+    sql = "UPDATE ts.task_schedule SET last_run_ok = false, time_retry = $2 "
+          "WHERE task_id = $1;";
+
+    Datum argValues[2];
+    Oid argTypes[2] = {
+        INT8OID,
+        TIMESTAMPTZOID,
+    };
+
+    argValues[0] = Int64GetDatum(taskId);
+    argValues[1] = TimestampTzGetDatum(retryAt);
+
+    if (SPI_execute_with_args(sql, 2, argTypes, argValues, NULL, false, 1) !=
+        SPI_OK_UPDATE)
+        elog(ERROR, "SPI_exec failed witch update batch failure");
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+}
+
+
+/*
+ * выполнить задачу batch
+ * команда выполняется в отдельных коротких транзакциях, пока очередная пачка
+ * не обработает 0 строк, но не больше batch_max_chunks_per_tick пачек за
+ * итерацию, между пачками делается пауза batch_chunk_pause, а если задан
+ * batch_max_wal_rate, то пауза увеличивается, чтобы не превышать этот объем WAL
+ * в секунду
+ * если задача не закончилась, её время не меняется и она продолжится
+ * на следующей итерации, а после ошибки пачки - через batch_retry_delay
+ */
+static void
+ExecuteBatchTask(Task *task)
+{
+    elog(DEBUG1, "pg_tkach_scheduler start ExecuteBatchTask");
+
+    // WAL считается только свой, по счетчикам процесса, выполнившего
+    // пачку, чтобы чужая запись в кластере не тормозила задачу
+    uint64 walBytes = 0;
+    TimestampTz startTime = GetCurrentTimestamp();
+
+    for (int chunk = 0; chunk < batch_max_chunks_per_tick && !isSigTerm; chunk++)
+    {
+        if (chunk > 0 && batch_chunk_pause > 0)
+            WorkerSleep(batch_chunk_pause);
+
+        TimestampTz chunkStart = GetCurrentTimestamp();
+
+        uint64 processed;
+        double chunkTime;
+
+        // пачка фиксируется исполнителем или самим воркером от имени
+        // владельца, прогресс сохраняется сразу после неё отдельной
+        // транзакцией воркера
+        bool ok = max_executors > 0 ? TSExecutorRun(task, &processed)
+                                    : ExecuteTaskInWorker(task, &processed);
+        if (!ok)
+        {
+            task->failed = true;
+            tickStats.tasks_failed++;
+            break;
+        }
+
+        chunkTime = (double)(GetCurrentTimestamp() - chunkStart) / 1000.0;
+        if (processed > 0)
+        {
+            StartTransactionCommand();
+            UpdateBatchProgress(task->task_id, processed, chunkTime);
+            CommitTransactionCommand();
+        }
+
+        task->exec_time += chunkTime;
+        walBytes += task->wal_bytes;
+        tickStats.batch_chunks++;
+
+        if (processed == 0)
+        {
+            task->batch_done = true;
+            break;
+        }
+
+        if (batch_max_wal_rate > 0)
+        {
+            double elapsedMs = (double)(GetCurrentTimestamp() - startTime) / 1000.0;
+            double allowedMs =
+                (double)walBytes / (batch_max_wal_rate * 1024.0) * 1000.0;
+
+            if (allowedMs > elapsedMs)
+                WorkerSleep((long)(allowedMs - elapsedMs));
+        }
+    }
+
+    elog(DEBUG1, "pg_tkach_scheduler end ExecuteBatchTask");
+}
+
+
+/*
+ * получить время следующего выполнения задачи, пропуская запуски,
+ * время которых уже прошло (например, пока воркер не работал)
+ * без этого просроченная задача выполнялась бы на каждой итерации
+ */
+static TimestampTz
+GetNextFutureTimeExec(Task *task, TimestampTz now)
+{
+    Interval *interval = task->exec_interval;
+
+    // интервал постоянной длины, например доли секунды, - пропущенные
+    // запуски считаются арифметикой, а не перебором по одному
+    if (interval != NULL && interval->month == 0 && interval->day == 0 &&
+        interval->time > 0)
+    {
+        TimestampTz t = task->time_next_exec;
+
+        if (t > now)
+            return t + interval->time;
+        return t + ((now - t) / interval->time + 1) * interval->time;
+    }
+
+    TimestampTz savedTimeNextExec = task->time_next_exec;
+    TimestampTz next = GetNewTimeNextExec(task);
+
+    // next > task->time_next_exec защищает от нулевого интервала
+    while (next <= now && next > task->time_next_exec)
+    {
+        task->time_next_exec = next;
+        next = GetNewTimeNextExec(task);
+    }
+
+    task->time_next_exec = savedTimeNextExec;
+    return next;
+}
+
+
+/*
+ * обновить время следующего выполнения задач
+ * если задача больше никогда не выполнится, то она удалится
+ * отложенные задачи не трогаются
+ */
+static void
+UpdateTaskStatus(List *taskList, TimestampTz now)
+{
+    elog(DEBUG1, "pg_tkach_scheduler start UpdateTaskStatus");
+    ListCell *cell;
+
+    UpdateTaskRetry(taskList);
+
+    foreach (cell, taskList)
+    {
+        Task *task = (Task *)lfirst(cell);
+
+        if (task->deferred)
+            continue;
+
+        switch (task->type)
+        {
+        case (Single):
+            DeleteTask(task->task_id);
+            break;
+
+        case (Repeat):
+            TimestampTz newTimeNextExec = GetNextFutureTimeExec(task, now);
+            UpdateTaskTimeNextExec(task->task_id,
+                                   newTimeNextExec,
+                                   task->exec_time,
+                                   !task->failed);
+            break;
+
+        case (RepeatLimit):
+            int repeat_limit = task->repeat_limit;
+            repeat_limit--;
+            if (repeat_limit == 0)
                 DeleteTask(task->task_id);
             else
-                UpdateRepeatLimitTask(task);
+                UpdateRepeatLimitTask(task, now);
             break;
 
         case (RepeatUntil):
             TimestampTz timeUntil = task->until;
-            TimestampTz timeNextExec = GetNewTimeNextExec(task);
+            TimestampTz timeNextExec = GetNextFutureTimeExec(task, now);
 
             if (timeUntil < timeNextExec)
                 DeleteTask(task->task_id);
             else
-                UpdateTaskTimeNextExec(task->task_id, timeNextExec);
+                UpdateTaskTimeNextExec(task->task_id,
+                                       timeNextExec,
+                                       task->exec_time,
+                                       !task->failed);
+            break;
+
+        case (Batch):
+            // прогресс уже сохранен после каждой пачки
+            if (task->failed)
+                UpdateBatchFailure(task->task_id,
+                                   now + (int64)batch_retry_delay *
+                                             USECS_PER_SEC);
+            else if (task->batch_done)
+                DeleteTask(task->task_id);
             break;
         }
     }
@@ -378,11 +1891,84 @@ UpdateTaskStatus(List *taskList)
 }
 
 
+/*
+ * сохранить время повтора отложенных задач одним запросом
+ * до этого времени задача не выбирается, поэтому отложенные задачи
+ * с самым ранним time_next_exec не занимают начало каждой выборки
+ */
+static void
+UpdateTaskRetry(List *taskList)
+{
+    ListCell *cell;
+    int count = 0;
+    Datum *ids = palloc(sizeof(Datum) * list_length(taskList));
+    Datum *times = palloc(sizeof(Datum) * list_length(taskList));
+
+    foreach (cell, taskList)
+    {
+        Task *task = (Task *)lfirst(cell);
+
+        if (!task->deferred || task->time_retry == 0)
+            continue;
+
+        ids[count] = Int64GetDatum(task->task_id);
+        times[count] = TimestampTzGetDatum(task->time_retry);
+        count++;
+    }
+
+    if (count > 0)
+    {
+        StartTransactionCommand();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        if (SPI_connect() != SPI_OK_CONNECT)
+            elog(ERROR, "failed to connect to SPI");
+
+        Datum argValues[2];
+        Oid argTypes[2] = { INT8ARRAYOID, TIMESTAMPTZARRAYOID };
+
+        argValues[0] = PointerGetDatum(construct_array(ids,
+                                                       count,
+                                                       INT8OID,
+                                                       sizeof(int64),
+                                                       FLOAT8PASSBYVAL,
+                                                       TYPALIGN_DOUBLE));
+        argValues[1] = PointerGetDatum(construct_array(times,
+                                                       count,
+                                                       TIMESTAMPTZOID,
+                                                       sizeof(TimestampTz),
+                                                       FLOAT8PASSBYVAL,
+                                                       TYPALIGN_DOUBLE));
+
+        if (SPI_execute_with_args(
+                "UPDATE ts.task_schedule s SET time_retry = r.time_retry "
+                "FROM unnest($1::BIGINT[], $2::TIMESTAMPTZ[]) "
+                "AS r (task_id, time_retry) WHERE s.task_id = r.task_id;",
+                2,
+                argTypes,
+                argValues,
+                NULL,
+                false,
+                0) != SPI_OK_UPDATE)
+            elog(ERROR, "SPI_exec failed witch update time_retry");
+
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+    }
+
+    pfree(ids);
+    pfree(times);
+}
+
+
 /*
  * обновить время следующего выполнения задачи
  */
 static void
-UpdateTaskTimeNextExec(int64 taskId, TimestampTz newNextTime)
+UpdateTaskTimeNextExec(int64 taskId,
+                       TimestampTz newNextTime,
+                       double execTime,
+                       bool ok)
 {
     elog(DEBUG1, "pg_tkach_scheduler start UpdateTaskTimeNextExec");
 
@@ -392,19 +1978,26 @@ UpdateTaskTimeNextExec(int64 taskId, TimestampTz newNextTime)
         elog(ERROR, "failed to connect to SPI");
 
     const char *sql;
-    sql = "UPDATE ts.task SET time_next_exec = $1 WHERE task_id = $2;";
+    sql = "UPDATE ts.task_schedule SET time_next_exec = $1, "
+          "exec_count = exec_count + 1, "
+          "exec_time_total = exec_time_total + $3, last_run_ok = $4, "
+          "time_retry = NULL WHERE task_id = $2;";
 
-    Datum argValues[2];
-    Oid argTypes[2] = {
+    Datum argValues[4];
+    Oid argTypes[4] = {
         TIMESTAMPTZOID,
         INT8OID,
+        FLOAT8OID,
+        BOOLOID,
     };
-    char argNulls[2] = { '\0', '\0' };
+    char argNulls[4] = { '\0', '\0', '\0', '\0' };
 
     argValues[0] = TimestampTzGetDatum(newNextTime);
     argValues[1] = Int64GetDatum(taskId);
+    argValues[2] = Float8GetDatum(execTime);
+    argValues[3] = BoolGetDatum(ok);
 
-    int countArgs = 2; // количество аргументов для SPI_execute_with_args
+    int countArgs = 4; // количество аргументов для SPI_execute_with_args
     bool res = (SPI_OK_UPDATE ==
                 SPI_execute_with_args(
                     sql, countArgs, argTypes, argValues, argNulls, false, 1));
@@ -424,7 +2017,7 @@ UpdateTaskTimeNextExec(int64 taskId, TimestampTz newNextTime)
  * обновить лимит выполнения задачи
  */
 static void
-UpdateRepeatLimitTask(Task *task)
+UpdateRepeatLimitTask(Task *task, TimestampTz now)
 {
     elog(DEBUG1, "pg_tkach_scheduler start UpdateRepeatLimitTask");
 
@@ -434,22 +2027,29 @@ UpdateRepeatLimitTask(Task *task)
         elog(ERROR, "failed to connect to SPI");
 
     const char *sql;
-    sql = "UPDATE ts.task SET repeat_limit = $1, time_next_exec = $2 WHERE "
-          "task_id = $3;";
+    sql = "UPDATE ts.task_schedule SET repeat_limit = $1, time_next_exec = $2, "
+          "exec_count = exec_count + 1, "
+          "exec_time_total = exec_time_total + $4, last_run_ok = $5, "
+          "time_retry = NULL WHERE task_id = $3;";
 
-    Datum argValues[3];
-    Oid argTypes[3] = {
+    Datum argValues[5];
+    Oid argTypes[5] = {
         INT8OID,
         TIMESTAMPTZOID,
         INT8OID,
+        FLOAT8OID,
+        BOOLOID,
     };
-    char argNulls[3] = { '\0', '\0', '\0' };
+    char argNulls[5] = { '\0', '\0', '\0', '\0', '\0' };
 
     argValues[0] = Int64GetDatum(task->repeat_limit - 1);
-    argValues[1] = TimestampTzGetDatum(GetNewTimeNextExec(task));
+    // пропущенные запуски не наверстываются, как и у задач repeat
+    argValues[1] = TimestampTzGetDatum(GetNextFutureTimeExec(task, now));
     argValues[2] = Int64GetDatum(task->task_id);
+    argValues[3] = Float8GetDatum(task->exec_time);
+    argValues[4] = BoolGetDatum(!task->failed);
 
-    int countArgs = 3; // количество аргументов для SPI_execute_with_args
+    int countArgs = 5; // количество аргументов для SPI_execute_with_args
     bool res = (SPI_OK_UPDATE ==
                 SPI_execute_with_args(
                     sql, countArgs, argTypes, argValues, argNulls, false, 1));
@@ -479,8 +2079,9 @@ DeleteTask(int64 taskId)
         elog(ERROR, "failed to connect to SPI");
 
     char sql[256];
+    // строка из ts.task_schedule удалится каскадно
     snprintf(
-        sql, sizeof(sql), "DELETE FROM ts.task WHERE task_id = %ld", taskId);
+        sql, sizeof(sql), "DELETE FROM ts.task_def WHERE task_id = %ld", taskId);
 
     if (SPI_execute(sql, false, 0) != SPI_OK_DELETE)
     {
@@ -526,19 +2127,47 @@ ScheduleTask(Task *task)
     elog(DEBUG1, "pg_tkach_scheduler ScheduleTask 3");
 
     const char *sql;
-    sql = "INSERT INTO ts.task"
-          "(type, command, exec_interval, time_next_exec, repeat_limit, "
-          "until, note, username, database) "
-          "VALUES ($1::ts.TASK_TYPE, $2::TEXT, $3::INTERVAL, $4::TIMESTAMPTZ, "
-          "$5::BIGINT, $6::TIMESTAMP, $7::TEXT, $8::TEXT, $9::TEXT) RETURNING "
-          "task_id;";
-
-    Datum argValues[9];
-    Oid argTypes[9] = {
+    // определение и расписание задачи вставляются одним запросом
+    // если задача с таким idempotency_key уже есть, она обновляется,
+    // но только если принадлежит тому же пользователю
+    sql = "WITH def AS ("
+          "INSERT INTO ts.task_def (command, note, username, database, "
+          "rate_group, idempotency_key, valid, func, args, settings, "
+          "fanout_parent, fanout_targets) "
+          "VALUES ($2::TEXT, $7::TEXT, $8::TEXT, $9::TEXT, $10::TEXT, "
+          "$12::TEXT, $13::BOOLEAN, $14::REGPROCEDURE, $15::TEXT[], "
+          "$16::TEXT[], $17::REGCLASS, $18::TEXT[]) "
+          "ON CONFLICT (idempotency_key) WHERE idempotency_key IS NOT NULL "
+          "DO UPDATE SET command = EXCLUDED.command, note = EXCLUDED.note, "
+          "database = EXCLUDED.database, rate_group = EXCLUDED.rate_group, "
+          "valid = EXCLUDED.valid, func = EXCLUDED.func, "
+          "args = EXCLUDED.args, settings = EXCLUDED.settings, "
+          "fanout_parent = EXCLUDED.fanout_parent, "
+          "fanout_targets = EXCLUDED.fanout_targets "
+          "WHERE task_def.username = EXCLUDED.username "
+          "RETURNING task_id) "
+          "INSERT INTO ts.task_schedule"
+          "(task_id, type, exec_interval, time_next_exec, repeat_limit, until, "
+          "deferrable) "
+          "SELECT task_id, $1::ts.TASK_TYPE, $3::INTERVAL, $4::TIMESTAMPTZ, "
+          "$5::BIGINT, $6::TIMESTAMPTZ, $11::BOOLEAN FROM def "
+          "ON CONFLICT (task_id) DO UPDATE SET type = EXCLUDED.type, "
+          "exec_interval = EXCLUDED.exec_interval, "
+          "time_next_exec = EXCLUDED.time_next_exec, "
+          "repeat_limit = EXCLUDED.repeat_limit, until = EXCLUDED.until, "
+          "deferrable = EXCLUDED.deferrable, time_retry = NULL "
+          "RETURNING task_id;";
+
+    Datum argValues[18];
+    Oid argTypes[18] = {
         TEXTOID,        TEXTOID, INTERVALOID, TIMESTAMPTZOID, INT8OID,
-        TIMESTAMPTZOID, TEXTOID, TEXTOID,     TEXTOID,
+        TIMESTAMPTZOID, TEXTOID, TEXTOID,     TEXTOID,        TEXTOID,
+        BOOLOID,        TEXTOID, BOOLOID,     OIDOID,         TEXTARRAYOID,
+        TEXTARRAYOID,   OIDOID,  TEXTARRAYOID,
     };
-    char argNulls[9] = { '\0', '\0', '\0', '\0', '\0', '\0', '\0', '\0', '\0' };
+    char argNulls[18] = { '\0', '\0', '\0', '\0', '\0', '\0',
+                          '\0', '\0', '\0', '\0', '\0', '\0',
+                          '\0', '\0', '\0', '\0', '\0', '\0' };
 
     elog(DEBUG1, "pg_tkach_scheduler ScheduleTask before TaskType");
     elog(DEBUG1,
@@ -571,15 +2200,69 @@ ScheduleTask(Task *task)
     argValues[7] = CStringGetTextDatum(task->username);
     argValues[8] = CStringGetTextDatum(task->database);
 
+    if (task->rate_group == NULL)
+        argNulls[9] = 'n';
+    else
+        argValues[9] = CStringGetTextDatum(task->rate_group);
+
+    argValues[10] = BoolGetDatum(task->deferrable);
+
+    if (task->idempotency_key == NULL)
+        argNulls[11] = 'n';
+    else
+        argValues[11] = CStringGetTextDatum(task->idempotency_key);
+
+    // NULL - запрос проверит воркер перед первым выполнением
+    if (!task->validated)
+        argNulls[12] = 'n';
+    else
+        argValues[12] = BoolGetDatum(true);
+
+    // функция и аргументы задачи в режиме вызова
+    if (!OidIsValid(task->func))
+    {
+        argNulls[13] = 'n';
+        argNulls[14] = 'n';
+    }
+    else
+    {
+        argValues[13] = ObjectIdGetDatum(task->func);
+        argValues[14] =
+            PointerGetDatum(TSCallArgsToArray(task->args, task->nargs));
+    }
+
+    if (task->settings == NULL)
+        argNulls[15] = 'n';
+    else
+        argValues[15] = PointerGetDatum(
+            TSCallArgsToArray(task->settings, task->nsettings));
+
+    // цели fan-out задачи
+    if (!OidIsValid(task->fanout_parent))
+        argNulls[16] = 'n';
+    else
+        argValues[16] = ObjectIdGetDatum(task->fanout_parent);
+
+    if (task->fanout_targets == NULL)
+        argNulls[17] = 'n';
+    else
+        argValues[17] = PointerGetDatum(
+            TSCallArgsToArray(task->fanout_targets, task->nfanout_targets));
+
     int ret =
-        SPI_execute_with_args(sql, 9, argTypes, argValues, argNulls, false, 1);
+        SPI_execute_with_args(sql, 18, argTypes, argValues, argNulls, false, 1);
 
     if (ret != SPI_OK_INSERT_RETURNING || SPI_processed == 0)
     {
         ereport(ERROR,
                 (errcode(ERRCODE_DATA_EXCEPTION),
                  errmsg("Failed to insert task"),
-                 errdetail("SPI error code: %d", ret)));
+                 errdetail("SPI error code: %d", ret),
+                 task->idempotency_key != NULL
+                     ? errhint("A task with idempotency key \"%s\" may "
+                               "belong to another user.",
+                               task->idempotency_key)
+                     : 0));
     }
 
     if (SPI_processed > 0)
@@ -620,6 +2303,8 @@ freeTaskList(List *list)
         pfree((void *)task->database);
         pfree((void *)task->note);
         pfree((void *)task->username);
+        if (task->rate_group != NULL)
+            pfree((void *)task->rate_group);
         pfree(task);
     }
     list_free(list);
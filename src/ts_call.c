@@ -0,0 +1,426 @@
+/* src/ts_call.c */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "access/htup_details.h"
+#include "catalog/objectaccess.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "lib/stringinfo.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/regproc.h"
+#include "utils/syscache.h"
+
+#include "task.h"
+#include "ts_call.h"
+
+
+/*
+ * подготовленный вызов функции задачи
+ * функция находится и аргументы разбираются один раз, дальше задача
+ * вызывает функцию напрямую, без разбора и планирования SQL
+ */
+typedef struct CallCacheEntry
+{
+    int64 task_id; // ключ хеш-таблицы
+    Oid func;
+    int nargs;
+    char **args;   // аргументы в текстовом виде, чтобы заметить их изменение
+    bool direct;   // false - процедура, выполняется через CALL
+    bool strict;
+    Oid rettype;
+    Oid collation; // правило сортировки вызова, InvalidOid - не нужно
+    FmgrInfo flinfo;
+    Datum *values;
+    bool *nulls;
+} CallCacheEntry;
+
+static HTAB *callCache = NULL;
+static MemoryContext callCacheContext = NULL;
+static bool callCacheCallbackRegistered = false;
+static bool callCacheValid = false;
+
+
+/*
+ * пометить кеш вызовов устаревшим при изменении или удалении любой функции
+ * сам кеш сбрасывается при следующем обращении, так как инвалидация может
+ * прийти, пока запись кеша заполняется
+ */
+static void
+InvalidateCallCache(Datum arg, int cacheid, uint32 hashvalue)
+{
+    callCacheValid = false;
+}
+
+
+/*
+ * проверить право текущего пользователя выполнять функцию задачи
+ */
+static void
+CheckCallPermission(Oid func)
+{
+    AclResult aclresult = pg_proc_aclcheck(func, GetUserId(), ACL_EXECUTE);
+    if (aclresult != ACLCHECK_OK)
+        aclcheck_error(aclresult, OBJECT_FUNCTION, get_func_name(func));
+}
+
+
+/*
+ * проверить функцию задачи и вернуть её строку pg_proc
+ * вызывающий должен освободить результат через ReleaseSysCache
+ */
+static HeapTuple
+LookupCallFunction(Oid func, int nargs)
+{
+    HeapTuple procTuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(func));
+    if (!HeapTupleIsValid(procTuple))
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_FUNCTION),
+                 errmsg("function with OID %u does not exist", func)));
+
+    CheckCallPermission(func);
+
+    Form_pg_proc proc = (Form_pg_proc)GETSTRUCT(procTuple);
+
+    if (proc->prokind != PROKIND_FUNCTION && proc->prokind != PROKIND_PROCEDURE)
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("%s is not a function or procedure",
+                        format_procedure(func))));
+
+    if (proc->proretset)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("set-returning function %s cannot be a task",
+                        format_procedure(func))));
+
+    if (proc->pronargs != nargs)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("%s expects %d arguments, %d given",
+                        format_procedure(func),
+                        proc->pronargs,
+                        nargs)));
+
+    for (int i = 0; i < nargs; i++)
+    {
+        if (IsPolymorphicType(proc->proargtypes.values[i]))
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("polymorphic function %s cannot be a task",
+                            format_procedure(func))));
+    }
+
+    return procTuple;
+}
+
+
+/*
+ * разобрать аргумент функции из текста по типу параметра
+ */
+static Datum
+InputCallArgument(Oid type, const char *value)
+{
+    Oid typinput;
+    Oid typioparam;
+
+    getTypeInputInfo(type, &typinput, &typioparam);
+    return OidInputFunctionCall(typinput, (char *)value, typioparam, -1);
+}
+
+
+/*
+ * проверить вызов функции с аргументами и построить текст команды,
+ * который показывается в ts.task и используется для CALL процедур
+ */
+char *
+TSCallCommand(Oid func, char **args, int nargs, TaskType type)
+{
+    HeapTuple procTuple = LookupCallFunction(func, nargs);
+    Form_pg_proc proc = (Form_pg_proc)GETSTRUCT(procTuple);
+    bool isProcedure = proc->prokind == PROKIND_PROCEDURE;
+
+    // задача batch выполняется, пока функция возвращает не 0
+    if (type == Batch && proc->prorettype != INT2OID &&
+        proc->prorettype != INT4OID && proc->prorettype != INT8OID)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg("function of a batch task must return an integer "
+                        "number of processed rows")));
+
+    StringInfoData command;
+    initStringInfo(&command);
+
+    appendStringInfo(
+        &command,
+        "%s %s(",
+        isProcedure ? "CALL" : "SELECT",
+        quote_qualified_identifier(get_namespace_name(proc->pronamespace),
+                                   NameStr(proc->proname)));
+
+    for (int i = 0; i < nargs; i++)
+    {
+        Oid argType = proc->proargtypes.values[i];
+
+        if (i > 0)
+            appendStringInfoString(&command, ", ");
+
+        if (args[i] == NULL)
+            appendStringInfoString(&command, "NULL");
+        else
+        {
+            // ошибка в значении аргумента обнаруживается при планировании
+            (void)InputCallArgument(argType, args[i]);
+            appendStringInfoString(&command, quote_literal_cstr(args[i]));
+        }
+
+        appendStringInfo(
+            &command, "::%s", format_type_be_qualified(argType));
+    }
+
+    appendStringInfoChar(&command, ')');
+
+    ReleaseSysCache(procTuple);
+    return command.data;
+}
+
+
+/*
+ * text[] аргументов в массив строк, NULL элементы остаются NULL
+ */
+void
+TSCallArgsFromArray(ArrayType *array, char ***args, int *nargs)
+{
+    Datum *elems;
+    bool *elemNulls;
+
+    deconstruct_array(
+        array, TEXTOID, -1, false, TYPALIGN_INT, &elems, &elemNulls, nargs);
+
+    *args = palloc(sizeof(char *) * Max(*nargs, 1));
+    for (int i = 0; i < *nargs; i++)
+        (*args)[i] = elemNulls[i] ? NULL : TextDatumGetCString(elems[i]);
+}
+
+
+/*
+ * массив строк аргументов в text[]
+ */
+ArrayType *
+TSCallArgsToArray(char **args, int nargs)
+{
+    Datum *elems = palloc(sizeof(Datum) * Max(nargs, 1));
+    bool *elemNulls = palloc(sizeof(bool) * Max(nargs, 1));
+    int dims[1] = { nargs };
+    int lbs[1] = { 1 };
+
+    for (int i = 0; i < nargs; i++)
+    {
+        elemNulls[i] = args[i] == NULL;
+        elems[i] = elemNulls[i] ? (Datum)0 : CStringGetTextDatum(args[i]);
+    }
+
+    if (nargs == 0)
+        return construct_empty_array(TEXTOID);
+
+    return construct_md_array(
+        elems, elemNulls, 1, dims, lbs, TEXTOID, -1, false, TYPALIGN_INT);
+}
+
+
+static bool
+SameCallArguments(CallCacheEntry *entry, Task *task)
+{
+    if (entry->func != task->func || entry->nargs != task->nargs)
+        return false;
+
+    for (int i = 0; i < entry->nargs; i++)
+    {
+        if ((entry->args[i] == NULL) != (task->args[i] == NULL))
+            return false;
+        if (entry->args[i] != NULL && strcmp(entry->args[i], task->args[i]) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * найти подготовленный вызов задачи или подготовить новый
+ */
+static CallCacheEntry *
+GetCallCacheEntry(Task *task)
+{
+    bool found;
+
+    if (!callCacheCallbackRegistered)
+    {
+        CacheRegisterSyscacheCallback(PROCOID, InvalidateCallCache, (Datum)0);
+        callCacheCallbackRegistered = true;
+    }
+
+    if (callCacheContext == NULL)
+        callCacheContext = AllocSetContextCreate(TopMemoryContext,
+                                                 "pg_tkach_scheduler call cache",
+                                                 ALLOCSET_DEFAULT_SIZES);
+
+    if (!callCacheValid)
+    {
+        MemoryContextReset(callCacheContext);
+        callCache = NULL;
+        callCacheValid = true;
+    }
+
+    if (callCache == NULL)
+    {
+        HASHCTL ctl;
+        ctl.keysize = sizeof(int64);
+        ctl.entrysize = sizeof(CallCacheEntry);
+        ctl.hcxt = callCacheContext;
+        callCache = hash_create("pg_tkach_scheduler call cache",
+                                256,
+                                &ctl,
+                                HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    CallCacheEntry *entry =
+        hash_search(callCache, &task->task_id, HASH_FIND, &found);
+
+    // задачу могли перепланировать с другой функцией или аргументами
+    if (found && SameCallArguments(entry, task))
+        return entry;
+
+    // запись добавляется только после успешной подготовки,
+    // чтобы ошибка не оставила в кеше наполовину заполненную запись
+    if (found)
+        hash_search(callCache, &task->task_id, HASH_REMOVE, NULL);
+
+    HeapTuple procTuple = LookupCallFunction(task->func, task->nargs);
+    Form_pg_proc proc = (Form_pg_proc)GETSTRUCT(procTuple);
+
+    MemoryContext oldcontext = MemoryContextSwitchTo(callCacheContext);
+
+    CallCacheEntry prepared;
+    prepared.task_id = task->task_id;
+    prepared.func = task->func;
+    prepared.nargs = task->nargs;
+    prepared.direct = proc->prokind == PROKIND_FUNCTION;
+    prepared.strict = proc->proisstrict;
+    prepared.rettype = proc->prorettype;
+    prepared.collation = InvalidOid;
+    prepared.args = palloc(sizeof(char *) * Max(task->nargs, 1));
+    prepared.values = palloc(sizeof(Datum) * Max(task->nargs, 1));
+    prepared.nulls = palloc(sizeof(bool) * Max(task->nargs, 1));
+
+    for (int i = 0; i < task->nargs; i++)
+    {
+        // как при вызове из SQL с аргументами-константами: функция получает
+        // правило сортировки типа первого сортируемого аргумента, а без
+        // сортируемых аргументов - никакого
+        Oid collation = get_typcollation(proc->proargtypes.values[i]);
+        if (!OidIsValid(prepared.collation))
+            prepared.collation = collation;
+
+        prepared.nulls[i] = task->args[i] == NULL;
+        prepared.args[i] = prepared.nulls[i] ? NULL : pstrdup(task->args[i]);
+        prepared.values[i] =
+            prepared.nulls[i]
+                ? (Datum)0
+                : InputCallArgument(proc->proargtypes.values[i], task->args[i]);
+    }
+
+    if (prepared.direct)
+        fmgr_info_cxt(task->func, &prepared.flinfo, callCacheContext);
+
+    MemoryContextSwitchTo(oldcontext);
+    ReleaseSysCache(procTuple);
+
+    entry = hash_search(callCache, &task->task_id, HASH_ENTER, &found);
+    *entry = prepared;
+    return entry;
+}
+
+
+/*
+ * является ли функция задачи процедурой
+ * процедура выполняется через CALL из command, как вызов от клиента,
+ * чтобы в ней работали COMMIT и ROLLBACK
+ */
+bool
+TSCallIsProcedure(Task *task)
+{
+    return !GetCallCacheEntry(task)->direct;
+}
+
+
+/*
+ * выполнить задачу прямым вызовом функции
+ * возвращает false, если функция - процедура, её нужно выполнить через CALL
+ * processed - результат функции, если она возвращает целое число
+ */
+bool
+TSCallExecute(Task *task, uint64 *processed)
+{
+    CallCacheEntry *entry = GetCallCacheEntry(task);
+
+    *processed = 0;
+
+    if (!entry->direct)
+        return false;
+
+    // право могли отозвать после того, как вызов попал в кеш,
+    // поэтому оно проверяется при каждом выполнении, как в SQL
+    CheckCallPermission(entry->func);
+    InvokeFunctionExecuteHook(entry->func);
+
+    // strict функция с NULL аргументом не вызывается, как и в SQL
+    if (entry->strict)
+    {
+        for (int i = 0; i < entry->nargs; i++)
+        {
+            if (entry->nulls[i])
+                return true;
+        }
+    }
+
+    LOCAL_FCINFO(fcinfo, FUNC_MAX_ARGS);
+
+    InitFunctionCallInfoData(
+        *fcinfo, &entry->flinfo, entry->nargs, entry->collation, NULL, NULL);
+
+    for (int i = 0; i < entry->nargs; i++)
+    {
+        fcinfo->args[i].value = entry->values[i];
+        fcinfo->args[i].isnull = entry->nulls[i];
+    }
+
+    Datum result = FunctionCallInvoke(fcinfo);
+
+    if (!fcinfo->isnull)
+    {
+        switch (entry->rettype)
+        {
+        case INT2OID:
+            *processed = Max(DatumGetInt16(result), 0);
+            break;
+        case INT4OID:
+            *processed = Max(DatumGetInt32(result), 0);
+            break;
+        case INT8OID:
+            *processed = Max(DatumGetInt64(result), 0);
+            break;
+        }
+    }
+
+    return true;
+}
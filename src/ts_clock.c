@@ -0,0 +1,255 @@
+/* src/ts_clock.c */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+#include "ts_clock.h"
+#include "ts_shmem.h"
+
+PG_FUNCTION_INFO_V1(ts_now);
+PG_FUNCTION_INFO_V1(ts_set_virtual_time);
+PG_FUNCTION_INFO_V1(ts_advance_time);
+
+// сколько ts.advance_time ждет воркеры, прежде чем сдаться
+#define TS_ADVANCE_WAIT_TIMEOUT_MS 60000
+
+
+/*
+ * текущее время планировщика: виртуальное, если оно включено
+ */
+TimestampTz
+TSNow(void)
+{
+    if (tsShared == NULL)
+        return GetCurrentTimestamp();
+
+    LWLockAcquire(tsShared->lock, LW_SHARED);
+    bool isVirtual = tsShared->clock.is_virtual;
+    TimestampTz now = tsShared->clock.virtual_now;
+    LWLockRelease(tsShared->lock);
+
+    return isVirtual ? now : GetCurrentTimestamp();
+}
+
+
+bool
+TSClockIsVirtual(void)
+{
+    if (tsShared == NULL)
+        return false;
+
+    LWLockAcquire(tsShared->lock, LW_SHARED);
+    bool isVirtual = tsShared->clock.is_virtual;
+    LWLockRelease(tsShared->lock);
+
+    return isVirtual;
+}
+
+
+static void
+TSClockUnregisterWorker(int code, Datum arg)
+{
+    int shard = DatumGetInt32(arg);
+
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+    tsShared->clock.worker_latch[shard] = NULL;
+    tsShared->clock.worker_seen[shard] = 0;
+    LWLockRelease(tsShared->lock);
+}
+
+
+/*
+ * запомнить латч воркера, чтобы сдвиг времени мог его разбудить
+ */
+void
+TSClockRegisterWorker(int shard)
+{
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+    tsShared->clock.worker_latch[shard] = MyLatch;
+    tsShared->clock.worker_seen[shard] = 0;
+    LWLockRelease(tsShared->lock);
+
+    before_shmem_exit(TSClockUnregisterWorker, Int32GetDatum(shard));
+}
+
+
+/*
+ * воркер обработал задачи до времени now и ждет
+ */
+void
+TSClockReportSeen(int shard, TimestampTz now)
+{
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+    tsShared->clock.worker_seen[shard] = now;
+    LWLockRelease(tsShared->lock);
+}
+
+
+/*
+ * разбудить воркеры, вызывается под эксклюзивной блокировкой
+ */
+static void
+WakeWorkers(void)
+{
+    for (int shard = 0; shard < TS_MAX_SHARDS; shard++)
+    {
+        if (tsShared->clock.worker_latch[shard] != NULL)
+            SetLatch(tsShared->clock.worker_latch[shard]);
+    }
+}
+
+
+/*
+ * дождаться, пока все воркеры обработают задачи до времени target
+ */
+static void
+WaitForWorkers(TimestampTz target)
+{
+    TimestampTz start = GetCurrentTimestamp();
+
+    for (;;)
+    {
+        bool done = true;
+
+        LWLockAcquire(tsShared->lock, LW_SHARED);
+        for (int shard = 0; shard < TS_MAX_SHARDS; shard++)
+        {
+            if (tsShared->clock.worker_latch[shard] != NULL &&
+                tsShared->clock.worker_seen[shard] < target)
+                done = false;
+        }
+        LWLockRelease(tsShared->lock);
+
+        if (done)
+            return;
+
+        if (TimestampDifferenceExceeds(
+                start, GetCurrentTimestamp(), TS_ADVANCE_WAIT_TIMEOUT_MS))
+        {
+            ereport(WARNING,
+                    (errmsg("pg_tkach_scheduler workers did not catch up "
+                            "with the virtual clock")));
+            return;
+        }
+
+        (void)WaitLatch(MyLatch,
+                        WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                        1,
+                        PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+
+static void
+CheckClockAccess(void)
+{
+    if (tsShared == NULL)
+        elog(ERROR, "pg_tkach_scheduler not found in shared_preload_libraries");
+
+    if (!superuser())
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("only superuser can change the scheduler clock")));
+}
+
+
+/*
+ * ts_now - текущее время планировщика
+ */
+Datum
+ts_now(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_TIMESTAMPTZ(TSNow());
+}
+
+
+/*
+ * ts_set_virtual_time - включить виртуальное время и установить его,
+ * NULL возвращает планировщик к реальному времени
+ */
+Datum
+ts_set_virtual_time(PG_FUNCTION_ARGS)
+{
+    CheckClockAccess();
+
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+
+    if (PG_ARGISNULL(0))
+        tsShared->clock.is_virtual = false;
+    else
+    {
+        TimestampTz virtualTime = PG_GETARG_TIMESTAMPTZ(0);
+
+        if (TIMESTAMP_NOT_FINITE(virtualTime))
+        {
+            LWLockRelease(tsShared->lock);
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("virtual time must be finite")));
+        }
+
+        tsShared->clock.is_virtual = true;
+        tsShared->clock.virtual_now = virtualTime;
+    }
+
+    WakeWorkers();
+    LWLockRelease(tsShared->lock);
+
+    PG_RETURN_VOID();
+}
+
+
+/*
+ * ts_advance_time - сдвинуть виртуальное время вперед
+ * если wait, ждет, пока воркеры выполнят задачи до нового времени,
+ * поэтому результат прогона не зависит от скорости сервера
+ */
+Datum
+ts_advance_time(PG_FUNCTION_ARGS)
+{
+    CheckClockAccess();
+
+    Interval *step = PG_GETARG_INTERVAL_P(0);
+    bool wait = PG_GETARG_BOOL(1);
+
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+
+    if (!tsShared->clock.is_virtual)
+    {
+        LWLockRelease(tsShared->lock);
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("virtual clock is not enabled"),
+                 errhint("Use ts.set_virtual_time() first.")));
+    }
+
+    TimestampTz virtualTime = tsShared->clock.virtual_now;
+    LWLockRelease(tsShared->lock);
+
+    virtualTime = DatumGetTimestampTz(DirectFunctionCall2(
+        timestamptz_pl_interval, TimestampTzGetDatum(virtualTime), PointerGetDatum(step)));
+
+    if (virtualTime < TSNow())
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("virtual time cannot go backwards")));
+
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+    tsShared->clock.virtual_now = virtualTime;
+    WakeWorkers();
+    LWLockRelease(tsShared->lock);
+
+    if (wait)
+        WaitForWorkers(virtualTime);
+
+    PG_RETURN_TIMESTAMPTZ(virtualTime);
+}
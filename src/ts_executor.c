@@ -0,0 +1,786 @@
+/* src/ts_executor.c */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "access/xact.h"
+#include "executor/spi.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/timeout.h"
+#include "utils/timestamp.h"
+
+#include "task.h"
+#include "ts_background_worker.h"
+#include "ts_executor.h"
+#include "ts_shmem.h"
+
+int max_executors = 4;
+int executor_idle_timeout = 60000; // мс
+
+// слоты пула исполнителей, их max_executors
+static TSExecutorSlot *tsExecutors = NULL;
+
+
+/*
+ * размер слотов пула в общей памяти
+ */
+Size
+TSExecutorShmemSize(void)
+{
+    return mul_size(Max(max_executors, 1), sizeof(TSExecutorSlot));
+}
+
+
+/*
+ * создать или подключить слоты пула, вызывается из shmem_startup_hook
+ */
+void
+TSExecutorShmemInit(void)
+{
+    bool found;
+
+    tsExecutors = ShmemInitStruct(
+        "pg_tkach_scheduler executors", TSExecutorShmemSize(), &found);
+    if (!found)
+        memset(tsExecutors, 0, TSExecutorShmemSize());
+}
+
+
+/*
+ * запустить процесс исполнителя в свободном слоте
+ * вызывается под эксклюзивной блокировкой tsShared->lock
+ */
+static bool
+StartExecutor(int slotIndex,
+              const char *username,
+              const char *database,
+              BackgroundWorkerHandle **handle)
+{
+    TSExecutorSlot *slot = &tsExecutors[slotIndex];
+    BackgroundWorker worker;
+
+    memset(&worker, 0, sizeof(BackgroundWorker));
+
+    worker.bgw_flags =
+        BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    worker.bgw_main_arg = Int32GetDatum(slotIndex);
+    worker.bgw_notify_pid = MyProcPid;
+    sprintf(worker.bgw_library_name, "pg_tkach_scheduler");
+    sprintf(worker.bgw_function_name, "TSExecutorMain");
+    snprintf(worker.bgw_name,
+             BGW_MAXLEN,
+             "pg_tkach_scheduler executor %s@%s",
+             username,
+             database);
+    snprintf(worker.bgw_type, BGW_MAXLEN, "pg_tkach_scheduler executor");
+
+    slot->state = TS_EXECUTOR_STARTING;
+    slot->generation++;
+    strlcpy(slot->username, username, NAMEDATALEN);
+    strlcpy(slot->database, database, NAMEDATALEN);
+    slot->pid = 0;
+    slot->latch = NULL;
+    slot->owner_latch = MyLatch;
+    slot->job = DSM_HANDLE_INVALID;
+    slot->job_done = false;
+
+    if (!RegisterDynamicBackgroundWorker(&worker, handle))
+    {
+        slot->state = TS_EXECUTOR_FREE;
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * подождать, пока запущенный исполнитель подключится к базе
+ */
+static bool
+WaitForExecutorStartup(int slotIndex,
+                       uint64 generation,
+                       BackgroundWorkerHandle *handle)
+{
+    TSExecutorSlot *slot = &tsExecutors[slotIndex];
+
+    for (;;)
+    {
+        LWLockAcquire(tsShared->lock, LW_SHARED);
+        bool started = slot->generation == generation &&
+                       slot->state == TS_EXECUTOR_IDLE;
+        bool failed = slot->generation != generation ||
+                      slot->state == TS_EXECUTOR_FREE;
+        LWLockRelease(tsShared->lock);
+
+        if (started)
+            return true;
+
+        pid_t pid;
+        if (failed || GetBackgroundWorkerPid(handle, &pid) == BGWH_STOPPED)
+            return false;
+
+        (void)WaitLatch(MyLatch,
+                        WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                        100,
+                        PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+
+/*
+ * занять исполнитель для задачи пользователя username в базе database
+ * сначала ищется свободный исполнитель этой пары, затем свободный слот,
+ * затем вытесняется давно простаивающий исполнитель другой пары
+ * если все исполнители заняты, ждет, а без wait возвращает NULL;
+ * также возвращает NULL, если исполнитель не удалось запустить
+ */
+static TSExecutor *
+AcquireExecutor(const char *username, const char *database, bool wait)
+{
+    for (;;)
+    {
+        int idle = -1;
+        int freeSlot = -1;
+        int victim = -1;
+
+        LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+
+        for (int i = 0; i < max_executors; i++)
+        {
+            TSExecutorSlot *slot = &tsExecutors[i];
+
+            if (slot->state == TS_EXECUTOR_FREE)
+            {
+                if (freeSlot < 0)
+                    freeSlot = i;
+            }
+            else if (slot->state == TS_EXECUTOR_IDLE)
+            {
+                if (strcmp(slot->username, username) == 0 &&
+                    strcmp(slot->database, database) == 0)
+                {
+                    idle = i;
+                    break;
+                }
+
+                if (victim < 0 ||
+                    slot->last_used < tsExecutors[victim].last_used)
+                    victim = i;
+            }
+        }
+
+        if (idle >= 0)
+        {
+            TSExecutorSlot *slot = &tsExecutors[idle];
+            slot->state = TS_EXECUTOR_BUSY;
+
+            TSExecutor *executor = palloc0(sizeof(TSExecutor));
+            executor->slot = idle;
+            executor->generation = slot->generation;
+
+            LWLockRelease(tsShared->lock);
+            return executor;
+        }
+
+        if (freeSlot >= 0)
+        {
+            BackgroundWorkerHandle *handle;
+
+            if (!StartExecutor(freeSlot, username, database, &handle))
+            {
+                LWLockRelease(tsShared->lock);
+                ereport(WARNING,
+                        (errmsg("pg_tkach_scheduler could not start executor "
+                                "for user \"%s\" in database \"%s\"",
+                                username,
+                                database),
+                         errhint("You may need to increase "
+                                 "max_worker_processes.")));
+                return NULL;
+            }
+
+            uint64 generation = tsExecutors[freeSlot].generation;
+            LWLockRelease(tsShared->lock);
+
+            bool started = WaitForExecutorStartup(freeSlot, generation, handle);
+            pfree(handle);
+
+            if (!started)
+            {
+                ereport(WARNING,
+                        (errmsg("pg_tkach_scheduler executor for user \"%s\" "
+                                "in database \"%s\" failed to start",
+                                username,
+                                database)));
+                return NULL;
+            }
+
+            // исполнитель подключился и ждет, занимаем его на следующем круге
+            continue;
+        }
+
+        // пул заполнен: останавливаем исполнитель другой пары,
+        // его слот освободится, когда процесс завершится
+        if (victim >= 0)
+        {
+            tsExecutors[victim].state = TS_EXECUTOR_STOPPING;
+            SetLatch(tsExecutors[victim].latch);
+        }
+
+        LWLockRelease(tsShared->lock);
+
+        if (!wait)
+            return NULL;
+
+        (void)WaitLatch(MyLatch,
+                        WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                        10,
+                        PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+
+/*
+ * занять исполнитель, дождавшись его, если все заняты
+ */
+TSExecutor *
+TSExecutorAcquire(const char *username, const char *database)
+{
+    return AcquireExecutor(username, database, true);
+}
+
+
+/*
+ * занять исполнитель, не дожидаясь освобождения занятых
+ * воркер, который уже держит исполнители, не должен ждать следующий,
+ * иначе два таких воркера могут занять весь пул и ждать друг друга
+ */
+TSExecutor *
+TSExecutorTryAcquire(const char *username, const char *database)
+{
+    return AcquireExecutor(username, database, false);
+}
+
+
+/*
+ * передать задачу или её проверку занятому исполнителю
+ */
+static void
+StartJob(TSExecutor *executor, Task *task, bool validate)
+{
+    Size commandLen = strlen(task->command) + 1;
+    Size size = offsetof(TSExecutorJob, data) + commandLen;
+
+    for (int i = 0; i < task->nargs; i++)
+        size += 1 + (task->args[i] != NULL ? strlen(task->args[i]) + 1 : 0);
+    for (int i = 0; i < task->nsettings; i++)
+        size += strlen(task->settings[i]) + 1;
+
+    executor->segment = dsm_create(size, 0);
+    executor->job = dsm_segment_address(executor->segment);
+
+    TSExecutorJob *job = executor->job;
+    memset(job, 0, offsetof(TSExecutorJob, data));
+    job->task_id = task->task_id;
+    job->func = task->func;
+    job->nargs = task->nargs;
+    job->nsettings = task->nsettings;
+    job->queue_job = task->queue_job;
+    job->validate = validate;
+
+    char *data = job->data;
+    memcpy(data, task->command, commandLen);
+    data += commandLen;
+
+    for (int i = 0; i < task->nargs; i++)
+    {
+        if (task->args[i] == NULL)
+            *data++ = 'n';
+        else
+        {
+            Size len = strlen(task->args[i]) + 1;
+            *data++ = 'v';
+            memcpy(data, task->args[i], len);
+            data += len;
+        }
+    }
+
+    for (int i = 0; i < task->nsettings; i++)
+    {
+        Size len = strlen(task->settings[i]) + 1;
+        memcpy(data, task->settings[i], len);
+        data += len;
+    }
+
+    TSExecutorSlot *slot = &tsExecutors[executor->slot];
+
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+    slot->owner_latch = MyLatch;
+    slot->job = dsm_segment_handle(executor->segment);
+    slot->job_done = false;
+    SetLatch(slot->latch);
+    LWLockRelease(tsShared->lock);
+}
+
+
+/*
+ * передать задачу занятому исполнителю, не дожидаясь её выполнения
+ */
+void
+TSExecutorStart(TSExecutor *executor, Task *task)
+{
+    StartJob(executor, task, false);
+}
+
+
+/*
+ * закончил ли исполнитель задачу (или завершился сам)
+ */
+bool
+TSExecutorIsDone(TSExecutor *executor)
+{
+    TSExecutorSlot *slot = &tsExecutors[executor->slot];
+
+    LWLockAcquire(tsShared->lock, LW_SHARED);
+    bool done = slot->job_done || slot->generation != executor->generation ||
+                slot->state == TS_EXECUTOR_FREE;
+    LWLockRelease(tsShared->lock);
+
+    return done;
+}
+
+
+/*
+ * дождаться результата задачи и вернуть исполнитель в пул
+ * processed и walBytes - сколько строк обработала задача и сколько WAL
+ * записала; возвращает false, если задача завершилась ошибкой
+ */
+bool
+TSExecutorFinish(TSExecutor *executor, uint64 *processed, uint64 *walBytes)
+{
+    while (!TSExecutorIsDone(executor))
+    {
+        (void)WaitLatch(MyLatch,
+                        WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                        1000,
+                        PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    TSExecutorSlot *slot = &tsExecutors[executor->slot];
+    TSExecutorJob *job = executor->job;
+    bool ok;
+
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+
+    if (slot->generation == executor->generation && slot->job_done)
+    {
+        ok = job->ok;
+        *processed = job->processed;
+        *walBytes = job->wal_bytes;
+
+        slot->job = DSM_HANDLE_INVALID;
+        slot->job_done = false;
+        slot->last_used = GetCurrentTimestamp();
+        if (slot->state == TS_EXECUTOR_BUSY)
+            slot->state = TS_EXECUTOR_IDLE;
+    }
+    else
+    {
+        // исполнитель завершился, не закончив задачу
+        ok = false;
+        *processed = 0;
+        *walBytes = 0;
+        strlcpy(job->error, "executor terminated", TS_EXECUTOR_ERROR_LEN);
+    }
+
+    LWLockRelease(tsShared->lock);
+
+    if (!ok)
+        ereport(WARNING,
+                (errmsg("pg_tkach_scheduler task %ld failed: %s",
+                        job->task_id,
+                        job->error)));
+
+    dsm_detach(executor->segment);
+    pfree(executor);
+
+    return ok;
+}
+
+
+/*
+ * выполнить задачу на исполнителе её пользователя и базы данных
+ * возвращает false, если задача завершилась ошибкой
+ * или исполнитель не удалось получить
+ */
+bool
+TSExecutorRun(Task *task, uint64 *processed)
+{
+    *processed = 0;
+    task->wal_bytes = 0;
+
+    TSExecutor *executor = TSExecutorAcquire(task->username, task->database);
+    if (executor == NULL)
+        return false;
+
+    TSExecutorStart(executor, task);
+    return TSExecutorFinish(executor, processed, &task->wal_bytes);
+}
+
+
+/*
+ * выполнить count задач на исполнителях, не больше parallel сразу
+ * в ok - результат каждой задачи, в exec_time задачи - её длительность
+ * первый исполнитель воркер ждет, а следующие занимает, только если они
+ * свободны: ожидание при занятых исполнителях могло бы заблокировать
+ * другой воркер, который тоже держит исполнители
+ */
+void
+TSExecutorRunAll(Task *tasks, int count, int parallel, bool *ok)
+{
+    TSExecutor **running = palloc0(sizeof(TSExecutor *) * parallel);
+    int *runningTask = palloc(sizeof(int) * parallel);
+    TimestampTz *startTime = palloc(sizeof(TimestampTz) * parallel);
+    int nrunning = 0;
+    int next = 0;
+
+    while (next < count || nrunning > 0)
+    {
+        // занимаем свободные места
+        for (int i = 0; i < parallel && next < count; i++)
+        {
+            if (running[i] != NULL)
+                continue;
+
+            Task *task = &tasks[next];
+            TSExecutor *executor =
+                nrunning == 0
+                    ? TSExecutorAcquire(task->username, task->database)
+                    : TSExecutorTryAcquire(task->username, task->database);
+
+            if (executor == NULL)
+            {
+                // исполнитель не удалось запустить, задача не выполнится
+                if (nrunning == 0)
+                {
+                    ok[next] = false;
+                    task->exec_time = 0;
+                    next++;
+                    continue;
+                }
+                break;
+            }
+
+            TSExecutorStart(executor, task);
+            running[i] = executor;
+            runningTask[i] = next++;
+            startTime[i] = GetCurrentTimestamp();
+            nrunning++;
+        }
+
+        // собираем результаты закончившихся
+        bool finished = false;
+        for (int i = 0; i < parallel; i++)
+        {
+            if (running[i] == NULL || !TSExecutorIsDone(running[i]))
+                continue;
+
+            Task *task = &tasks[runningTask[i]];
+            uint64 processed;
+
+            ok[runningTask[i]] =
+                TSExecutorFinish(running[i], &processed, &task->wal_bytes);
+            task->exec_time =
+                (double)(GetCurrentTimestamp() - startTime[i]) / 1000.0;
+
+            running[i] = NULL;
+            nrunning--;
+            finished = true;
+        }
+
+        // исполнитель будит воркер, когда заканчивает задачу
+        if (!finished && nrunning > 0)
+        {
+            (void)WaitLatch(MyLatch,
+                            WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                            1000,
+                            PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+            CHECK_FOR_INTERRUPTS();
+        }
+    }
+
+    pfree(running);
+    pfree(runningTask);
+    pfree(startTime);
+}
+
+
+/*
+ * проверить запрос задачи на исполнителе: от имени её владельца, с его
+ * настройками ролей, в её базе данных - так же, как она будет выполняться
+ * возвращает false, если проверка не выполнилась (нет исполнителя или он
+ * завершился), тогда valid не определен
+ */
+bool
+TSExecutorValidate(Task *task, bool *valid)
+{
+    uint64 checked;
+    uint64 walBytes;
+
+    TSExecutor *executor = TSExecutorAcquire(task->username, task->database);
+    if (executor == NULL)
+        return false;
+
+    StartJob(executor, task, true);
+    *valid = TSExecutorFinish(executor, &checked, &walBytes);
+
+    return checked > 0;
+}
+
+
+/*
+ * освободить слот при завершении процесса исполнителя, в том числе по FATAL
+ */
+static void
+ExecutorExit(int code, Datum arg)
+{
+    TSExecutorSlot *slot = &tsExecutors[DatumGetInt32(arg)];
+
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+    slot->state = TS_EXECUTOR_FREE;
+    slot->pid = 0;
+    slot->latch = NULL;
+    if (slot->owner_latch != NULL)
+        SetLatch(slot->owner_latch);
+    LWLockRelease(tsShared->lock);
+}
+
+
+/*
+ * выполнить задачу из сегмента DSM в отдельной транзакции
+ * ошибка задачи перехватывается и передается воркеру
+ */
+static void
+ExecuteJob(TSExecutorSlot *slot, dsm_handle handle)
+{
+    dsm_segment *segment = dsm_attach(handle);
+    if (segment == NULL)
+        return;
+
+    TSExecutorJob *job = dsm_segment_address(segment);
+    Task task;
+
+    memset(&task, 0, sizeof(Task));
+    task.task_id = job->task_id;
+    task.command = job->data;
+    task.func = job->func;
+    task.nargs = job->nargs;
+    task.nsettings = job->nsettings;
+    task.queue_job = job->queue_job;
+
+    char *data = job->data + strlen(job->data) + 1;
+
+    if (task.nargs > 0)
+    {
+        task.args = palloc(sizeof(char *) * task.nargs);
+        for (int i = 0; i < task.nargs; i++)
+        {
+            if (*data++ == 'n')
+                task.args[i] = NULL;
+            else
+            {
+                task.args[i] = data;
+                data += strlen(data) + 1;
+            }
+        }
+    }
+
+    if (task.nsettings > 0)
+    {
+        task.settings = palloc(sizeof(char *) * task.nsettings);
+        for (int i = 0; i < task.nsettings; i++)
+        {
+            task.settings[i] = data;
+            data += strlen(data) + 1;
+        }
+    }
+
+    MemoryContext oldcontext = CurrentMemoryContext;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    pgstat_report_activity(STATE_RUNNING, task.command);
+
+    PG_TRY();
+    {
+        if (job->validate)
+        {
+            // при проверке processed = 1 означает, что она выполнилась,
+            // а результат проверки - ok
+            PushActiveSnapshot(GetTransactionSnapshot());
+            if (SPI_connect() != SPI_OK_CONNECT)
+                elog(ERROR, "failed to connect to SPI");
+
+            SPIPlanPtr plan = SPI_prepare(task.command, 0, NULL);
+            if (plan == NULL)
+                elog(ERROR,
+                     "SPI_prepare failed: %s",
+                     SPI_result_code_string(SPI_result));
+
+            SPI_finish();
+            PopActiveSnapshot();
+            job->processed = 1;
+        }
+        else
+        {
+            job->processed = ExecuteTask(&task);
+            job->wal_bytes = task.wal_bytes;
+        }
+        CommitTransactionCommand();
+        job->ok = true;
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(oldcontext);
+        ErrorData *edata = CopyErrorData();
+        FlushErrorState();
+
+        // задача могла прерваться, не остановив таймер statement_timeout
+        disable_timeout(STATEMENT_TIMEOUT, false);
+        AbortCurrentTransaction();
+
+        if (job->validate)
+            job->processed = 1;
+        job->ok = false;
+        strlcpy(job->error, edata->message, TS_EXECUTOR_ERROR_LEN);
+        FreeErrorData(edata);
+    }
+    PG_END_TRY();
+
+    // воркер перенесет транзакцию в общую статистику на своей итерации
+    pg_atomic_fetch_add_u64(&tsShared->executor_transactions, 1);
+
+    pgstat_report_activity(STATE_IDLE, NULL);
+
+    if (task.args != NULL)
+        pfree(task.args);
+    if (task.settings != NULL)
+        pfree(task.settings);
+
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+    slot->job_done = true;
+    if (slot->owner_latch != NULL)
+        SetLatch(slot->owner_latch);
+    LWLockRelease(tsShared->lock);
+
+    dsm_detach(segment);
+}
+
+
+/*
+ * главная функция исполнителя
+ * исполнитель подключается к базе данных от имени владельца задач
+ * и выполняет их, пока не простаивает дольше executor_idle_timeout
+ */
+void
+TSExecutorMain(Datum arg)
+{
+    int slotIndex = DatumGetInt32(arg);
+    TSExecutorSlot *slot = &tsExecutors[slotIndex];
+    char username[NAMEDATALEN];
+    char database[NAMEDATALEN];
+
+    pqsignal(SIGTERM, die);
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    BackgroundWorkerUnblockSignals();
+
+    // слот освобождается, даже если подключиться к базе не удалось
+    before_shmem_exit(ExecutorExit, arg);
+
+    LWLockAcquire(tsShared->lock, LW_SHARED);
+    strlcpy(username, slot->username, NAMEDATALEN);
+    strlcpy(database, slot->database, NAMEDATALEN);
+    LWLockRelease(tsShared->lock);
+
+    BackgroundWorkerInitializeConnection(database, username, 0);
+    pgstat_report_appname("pg_tkach_scheduler executor");
+
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+    slot->pid = MyProcPid;
+    slot->latch = MyLatch;
+    slot->last_used = GetCurrentTimestamp();
+    slot->state = TS_EXECUTOR_IDLE;
+    if (slot->owner_latch != NULL)
+        SetLatch(slot->owner_latch);
+    LWLockRelease(tsShared->lock);
+
+    elog(DEBUG1,
+         "pg_tkach_scheduler executor started for %s@%s",
+         username,
+         database);
+
+    for (;;)
+    {
+        CHECK_FOR_INTERRUPTS();
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+
+        TSExecutorState state = slot->state;
+        dsm_handle job = slot->job;
+        bool jobDone = slot->job_done;
+
+        // простаивающий исполнитель завершается, освобождая место в пуле
+        if (state == TS_EXECUTOR_IDLE &&
+            TimestampDifferenceExceeds(slot->last_used,
+                                       GetCurrentTimestamp(),
+                                       executor_idle_timeout))
+            state = slot->state = TS_EXECUTOR_STOPPING;
+
+        LWLockRelease(tsShared->lock);
+
+        if (state == TS_EXECUTOR_STOPPING)
+            break;
+
+        if (state == TS_EXECUTOR_BUSY && job != DSM_HANDLE_INVALID && !jobDone)
+        {
+            ExecuteJob(slot, job);
+            continue;
+        }
+
+        (void)WaitLatch(MyLatch,
+                        WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                        executor_idle_timeout,
+                        PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+    }
+
+    elog(DEBUG1, "pg_tkach_scheduler executor exiting");
+    proc_exit(0);
+}
@@ -0,0 +1,283 @@
+/* src/ts_fanout.c */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "access/xact.h"
+#include "catalog/pg_type_d.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+#include "task.h"
+#include "ts_background_worker.h"
+#include "ts_executor.h"
+#include "ts_fanout.h"
+
+// сколько целей одной задачи выполняется одновременно
+int fanout_max_parallel = 4;
+
+
+/*
+ * команда для одной цели: шаблон, в котором каждое вхождение
+ * TS_FANOUT_PLACEHOLDER заменено на target
+ */
+char *
+TSFanoutCommand(const char *command, const char *target)
+{
+    StringInfoData buf;
+    Size placeholderLen = strlen(TS_FANOUT_PLACEHOLDER);
+    const char *pos;
+
+    initStringInfo(&buf);
+
+    while ((pos = strstr(command, TS_FANOUT_PLACEHOLDER)) != NULL)
+    {
+        appendBinaryStringInfo(&buf, command, pos - command);
+        appendStringInfoString(&buf, target);
+        command = pos + placeholderLen;
+    }
+    appendStringInfoString(&buf, command);
+
+    return buf.data;
+}
+
+
+/*
+ * проверить параметры fan-out задачи при планировании
+ */
+void
+TSFanoutCheck(Task *task)
+{
+    if (OidIsValid(task->fanout_parent) && task->fanout_targets != NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("fanout_parent and fanout_targets cannot be used "
+                        "together")));
+
+    if (task->fanout_targets != NULL && task->nfanout_targets == 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("fanout_targets must not be empty")));
+
+    for (int i = 0; i < task->nfanout_targets; i++)
+        if (task->fanout_targets[i] == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("fanout target must be NOT NULL")));
+
+    if (OidIsValid(task->func))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("fanout cannot be used with func")));
+
+    if (task->type == Batch)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("fanout cannot be used in batch task")));
+
+    if (strstr(task->command, TS_FANOUT_PLACEHOLDER) == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("command of a fanout task must contain %s",
+                        TS_FANOUT_PLACEHOLDER)));
+}
+
+
+/*
+ * цели задачи: явно заданный список или листовые секции fanout_parent
+ * секции перечитываются при каждом выполнении, так что новые секции
+ * попадают в задачу сами; большие секции идут первыми, чтобы самая
+ * долгая часть не начиналась последней
+ * возвращает false, если секции прочитать не удалось, например таблицу
+ * fanout_parent удалили после планирования
+ */
+static bool
+GetFanoutTargets(Task *task, char ***targets, int *count)
+{
+    if (!OidIsValid(task->fanout_parent))
+    {
+        *targets = task->fanout_targets;
+        *count = task->nfanout_targets;
+        return true;
+    }
+
+    MemoryContext oldcontext = CurrentMemoryContext;
+    volatile bool ok = true;
+
+    *targets = NULL;
+    *count = 0;
+
+    StartTransactionCommand();
+
+    PG_TRY();
+    {
+        // удаленная таблица дала бы пустой список секций,
+        // а задача - выполниться без единой части
+        if (get_rel_name(task->fanout_parent) == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_UNDEFINED_TABLE),
+                     errmsg("fanout_parent %u does not exist",
+                            task->fanout_parent)));
+
+        PushActiveSnapshot(GetTransactionSnapshot());
+        if (SPI_connect() != SPI_OK_CONNECT)
+            elog(ERROR, "failed to connect to SPI");
+
+        const char *sql;
+        sql = "SELECT pg_catalog.quote_ident(n.nspname) || '.' || "
+              "pg_catalog.quote_ident(c.relname) "
+              "FROM pg_catalog.pg_partition_tree($1) t "
+              "JOIN pg_catalog.pg_class c ON c.oid = t.relid "
+              "JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace "
+              "WHERE t.isleaf "
+              "ORDER BY pg_catalog.pg_relation_size(t.relid) DESC, 1";
+
+        Datum argValues[1];
+        Oid argTypes[1] = { REGCLASSOID };
+
+        argValues[0] = ObjectIdGetDatum(task->fanout_parent);
+
+        if (SPI_execute_with_args(sql, 1, argTypes, argValues, NULL, true, 0) !=
+            SPI_OK_SELECT)
+            elog(ERROR, "SPI_exec failed while selecting fanout partitions");
+
+        *count = SPI_processed;
+
+        MemoryContextSwitchTo(oldcontext);
+        *targets = palloc(sizeof(char *) * Max(*count, 1));
+        for (int i = 0; i < *count; i++)
+            (*targets)[i] =
+                SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
+
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(oldcontext);
+        ErrorData *edata = CopyErrorData();
+        FlushErrorState();
+        AbortCurrentTransaction();
+
+        ereport(WARNING,
+                (errmsg("pg_tkach_scheduler task %ld cannot read fanout "
+                        "partitions: %s",
+                        task->task_id,
+                        edata->message)));
+        FreeErrorData(edata);
+        ok = false;
+    }
+    PG_END_TRY();
+
+    MemoryContextSwitchTo(oldcontext);
+
+    if (!ok)
+        *count = 0;
+    return ok;
+}
+
+
+/*
+ * выполнить fan-out задачу: команда выполняется для каждой цели отдельно,
+ * каждая в своей транзакции, на исполнителях - параллельно
+ * возвращает true, если все части выполнились без ошибок
+ */
+bool
+TSFanoutRun(Task *task, TSStats *stats)
+{
+    elog(DEBUG1, "pg_tkach_scheduler start TSFanoutRun");
+
+    int count;
+    char **targets;
+
+    if (!GetFanoutTargets(task, &targets, &count))
+    {
+        stats->tasks_failed++;
+        return false;
+    }
+
+    if (count == 0)
+    {
+        ereport(WARNING,
+                (errmsg("pg_tkach_scheduler task %ld has no fanout targets",
+                        task->task_id)));
+        return false;
+    }
+
+    char **commands = palloc(sizeof(char *) * count);
+    for (int i = 0; i < count; i++)
+        commands[i] = TSFanoutCommand(task->command, targets[i]);
+
+    int failed = 0;
+
+    if (max_executors > 0)
+    {
+        // части выполняются на исполнителях параллельно
+        Task *parts = palloc(sizeof(Task) * count);
+        bool *ok = palloc(sizeof(bool) * count);
+
+        for (int i = 0; i < count; i++)
+        {
+            parts[i] = *task;
+            parts[i].command = commands[i];
+
+            elog(DEBUG1,
+                 "pg_tkach_scheduler task %ld fanout: %s",
+                 task->task_id,
+                 parts[i].command);
+        }
+
+        TSExecutorRunAll(
+            parts, count, Min(fanout_max_parallel, max_executors), ok);
+
+        for (int i = 0; i < count; i++)
+        {
+            if (!ok[i])
+                failed++;
+        }
+
+        pfree(parts);
+        pfree(ok);
+    }
+    else
+    {
+        // без исполнителей части выполняются по очереди в самом воркере,
+        // ошибка части, как и на исполнителях, не останавливает остальные
+        for (int i = 0; i < count; i++)
+        {
+            Task part = *task;
+            part.command = commands[i];
+
+            uint64 processed;
+            if (!ExecuteTaskInWorker(&part, &processed))
+                failed++;
+        }
+    }
+
+    stats->fanout_targets += count;
+    stats->tasks_failed += failed;
+
+    for (int i = 0; i < count; i++)
+        pfree(commands[i]);
+    pfree(commands);
+
+    // список секций прочитан этим выполнением
+    if (OidIsValid(task->fanout_parent))
+    {
+        for (int i = 0; i < count; i++)
+            pfree(targets[i]);
+        pfree(targets);
+    }
+
+    elog(DEBUG1,
+         "pg_tkach_scheduler end TSFanoutRun: %d targets, %d failed",
+         count,
+         failed);
+    return failed == 0;
+}
@@ -0,0 +1,302 @@
+/* src/ts_forecast.c */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "catalog/pg_type_d.h"
+#include "executor/spi.h"
+#include "utils/builtins.h"
+#include "utils/elog.h"
+#include "utils/fmgrprotos.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "task.h"
+
+PG_FUNCTION_INFO_V1(ts_forecast);
+
+// ограничение, чтобы случайно не выделить слишком много памяти
+#define TS_FORECAST_MAX_BUCKETS 1000000
+
+
+/*
+ * окно прогноза, разбитое на интервалы одинаковой ширины
+ */
+typedef struct ForecastWindow
+{
+    TimestampTz from;
+    TimestampTz to;    // не включительно
+    int64 width;       // ширина интервала в микросекундах
+    int64 nbuckets;
+    int64 *counts;     // количество выполнений в интервале
+    double *durations; // ожидаемое суммарное время выполнения, мс
+} ForecastWindow;
+
+
+static void
+AddExecutions(ForecastWindow *w, int64 bucket, int64 count, double avgDuration)
+{
+    w->counts[bucket] += count;
+    w->durations[bucket] += count * avgDuration;
+}
+
+
+/*
+ * разложить по интервалам запуски first, first + step, ..., не позже last
+ * перебирается меньшее из количества запусков и количества интервалов,
+ * сами запуски не материализуются
+ */
+static void
+ForecastFixedStep(ForecastWindow *w,
+                  TimestampTz first,
+                  TimestampTz last,
+                  int64 step,
+                  double avgDuration)
+{
+    if (step >= w->width)
+    {
+        // в каждый интервал попадает не больше одного запуска
+        int64 count = (last - first) / step + 1;
+        for (int64 k = 0; k < count; k++)
+            AddExecutions(
+                w, (first + k * step - w->from) / w->width, 1, avgDuration);
+        return;
+    }
+
+    int64 firstBucket = (first - w->from) / w->width;
+    int64 lastBucket = (last - w->from) / w->width;
+
+    for (int64 b = firstBucket; b <= lastBucket; b++)
+    {
+        TimestampTz bucketStart = w->from + b * w->width;
+        TimestampTz lo = Max(bucketStart, first);
+        TimestampTz hi = Min(bucketStart + w->width - 1, last);
+
+        // номера запусков first + k * step, попадающих в [lo, hi]
+        int64 kLo = (lo - first + step - 1) / step;
+        int64 kHi = (hi - first) / step;
+
+        if (kHi >= kLo)
+            AddExecutions(w, b, kHi - kLo + 1, avgDuration);
+    }
+}
+
+
+/*
+ * добавить в прогноз все запуски одной задачи
+ * remaining - сколько ещё раз выполнится задача, -1 - без ограничения
+ */
+static void
+ForecastTask(ForecastWindow *w, Task *task, int64 remaining, double avgDuration)
+{
+    TimestampTz t = task->time_next_exec;
+    TimestampTz last = w->to - 1;
+
+    // задача repeat_until выполняется, пока время не превысило until
+    if (task->type == RepeatUntil && task->until < last)
+        last = task->until;
+
+    if (task->type == Single || task->exec_interval == NULL)
+    {
+        if (t >= w->from && t <= last)
+            AddExecutions(w, (t - w->from) / w->width, 1, avgDuration);
+        return;
+    }
+
+    Interval *interval = task->exec_interval;
+
+    if (interval->month == 0 && interval->day == 0)
+    {
+        // интервал постоянной длины - считаем запуски арифметикой
+        int64 step = interval->time;
+
+        if (step <= 0)
+        {
+            if (t >= w->from && t <= last)
+                AddExecutions(w, (t - w->from) / w->width, 1, avgDuration);
+            return;
+        }
+
+        // пропускаем запуски до начала окна
+        if (t < w->from)
+        {
+            int64 skipped = (w->from - t + step - 1) / step;
+            t += skipped * step;
+            if (remaining >= 0)
+                remaining = Max(remaining - skipped, 0);
+        }
+
+        if (remaining == 0 || t > last)
+            return;
+
+        if (remaining > 0 && (last - t) / step + 1 > remaining)
+            last = t + (remaining - 1) * step;
+
+        ForecastFixedStep(w, t, last, step, avgDuration);
+        return;
+    }
+
+    // в интервале есть дни или месяцы, длина которых зависит от календаря,
+    // поэтому запуски перебираются по одному так же, как это делает воркер
+    while (t <= last && remaining != 0)
+    {
+        if (t >= w->from)
+            AddExecutions(w, (t - w->from) / w->width, 1, avgDuration);
+
+        task->time_next_exec = t;
+        TimestampTz next = GetNewTimeNextExec(task);
+        if (next <= t)
+            break;
+
+        t = next;
+        if (remaining > 0)
+            remaining--;
+    }
+}
+
+
+/*
+ * ts_forecast - прогноз количества выполнений задач по интервалам времени
+ * для каждого интервала возвращается количество выполнений,
+ * среднее и суммарное ожидаемое время выполнения по истории задач
+ */
+Datum
+ts_forecast(PG_FUNCTION_ARGS)
+{
+    ForecastWindow w;
+    Interval *bucket = PG_GETARG_INTERVAL_P(2);
+
+    w.from = PG_GETARG_TIMESTAMPTZ(0);
+    w.to = PG_GETARG_TIMESTAMPTZ(1);
+
+    if (TIMESTAMP_NOT_FINITE(w.from) || TIMESTAMP_NOT_FINITE(w.to))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("forecast window must be finite")));
+
+    if (w.to <= w.from)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("to_time must be later than from_time")));
+
+    if (bucket->month != 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("bucket must not contain months")));
+
+    w.width = bucket->time + (int64)bucket->day * USECS_PER_DAY;
+    if (w.width <= 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("bucket must be positive")));
+
+    w.nbuckets = (w.to - w.from - 1) / w.width + 1;
+    if (w.nbuckets > TS_FORECAST_MAX_BUCKETS)
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                 errmsg("too many buckets in forecast window"),
+                 errhint("Use a larger bucket, at most %d buckets are allowed.",
+                         TS_FORECAST_MAX_BUCKETS)));
+
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+        !(rsinfo->allowedModes & SFRM_Materialize))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("set-valued function called in context that cannot "
+                        "accept a set")));
+
+    // массивы выделяются до SPI_connect, чтобы пережить SPI_finish
+    w.counts = palloc0(sizeof(int64) * w.nbuckets);
+    w.durations = palloc0(sizeof(double) * w.nbuckets);
+
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "failed to connect to SPI");
+
+    int ret = SPI_execute("SELECT type, time_next_exec, exec_interval, "
+                          "repeat_limit, until, exec_count, exec_time_total "
+                          "FROM ts.task_schedule",
+                          true,
+                          0);
+    if (ret != SPI_OK_SELECT)
+        elog(ERROR, "SPI_exec failed while selecting tasks: %d", ret);
+
+    SPITupleTable *tuptable = SPI_tuptable;
+    TupleDesc tupdesc = tuptable->tupdesc;
+
+    for (uint64 i = 0; i < SPI_processed; i++)
+    {
+        HeapTuple tuple = tuptable->vals[i];
+        Task task;
+        bool isnull;
+
+        memset(&task, 0, sizeof(Task));
+
+        task.type = CStringToTaskType(DatumGetCString(DirectFunctionCall1(
+            enum_out, SPI_getbinval(tuple, tupdesc, 1, &isnull))));
+        task.time_next_exec =
+            DatumGetTimestampTz(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+
+        Datum intervalDatum = SPI_getbinval(tuple, tupdesc, 3, &isnull);
+        task.exec_interval = isnull ? NULL : DatumGetIntervalP(intervalDatum);
+
+        int64 remaining = -1;
+        if (task.type == RepeatLimit)
+            remaining =
+                DatumGetInt64(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+
+        if (task.type == RepeatUntil)
+            task.until =
+                DatumGetTimestampTz(SPI_getbinval(tuple, tupdesc, 5, &isnull));
+
+        int64 execCount =
+            DatumGetInt64(SPI_getbinval(tuple, tupdesc, 6, &isnull));
+        double execTimeTotal =
+            DatumGetFloat8(SPI_getbinval(tuple, tupdesc, 7, &isnull));
+        double avgDuration = execCount > 0 ? execTimeTotal / execCount : 0;
+
+        ForecastTask(&w, &task, remaining, avgDuration);
+    }
+
+    SPI_finish();
+
+    // результат складывается в tuplestore целиком
+    MemoryContext oldcontext =
+        MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+    TupleDesc resultDesc;
+    if (get_call_result_type(fcinfo, NULL, &resultDesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    Tuplestorestate *tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = resultDesc;
+
+    MemoryContextSwitchTo(oldcontext);
+
+    for (int64 b = 0; b < w.nbuckets; b++)
+    {
+        Datum values[4];
+        bool nulls[4] = { false, false, false, false };
+
+        values[0] = TimestampTzGetDatum(w.from + b * w.width);
+        values[1] = Int64GetDatum(w.counts[b]);
+
+        if (w.counts[b] > 0)
+            values[2] = Float8GetDatum(w.durations[b] / w.counts[b]);
+        else
+            nulls[2] = true;
+
+        values[3] = Float8GetDatum(w.durations[b]);
+
+        tuplestore_putvalues(tupstore, resultDesc, values, nulls);
+    }
+
+    pfree(w.counts);
+    pfree(w.durations);
+
+    return (Datum)0;
+}
@@ -0,0 +1,252 @@
+/* src/ts_metrics.c */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "lib/stringinfo.h"
+#include "storage/fd.h"
+#include "utils/builtins.h"
+
+#include "ts_metrics.h"
+#include "ts_shmem.h"
+#include "ts_stats.h"
+
+PG_FUNCTION_INFO_V1(ts_metrics_text);
+
+int metrics_file_interval = 15; // с
+
+static const double histogramBounds[TS_HISTOGRAM_BUCKETS] = TS_HISTOGRAM_BOUNDS;
+
+
+/*
+ * метрика из поля TSStats
+ */
+typedef struct TSMetric
+{
+    const char *name;
+    const char *type; // counter или gauge
+    const char *help;
+    size_t offset;
+    double scale; // множитель, чтобы перевести значение в базовые единицы
+} TSMetric;
+
+static const TSMetric metrics[] = {
+    { "ticks_total", "counter", "Worker checks.",
+      offsetof(TSStats, ticks), 1 },
+    { "tasks_executed_total", "counter", "Executed tasks.",
+      offsetof(TSStats, tasks_executed), 1 },
+    { "tasks_rate_limited_total", "counter",
+      "Tasks deferred by rate limit groups.",
+      offsetof(TSStats, tasks_rate_limited), 1 },
+    { "tasks_admission_deferred_total", "counter",
+      "Tasks deferred by admission control.",
+      offsetof(TSStats, tasks_admission_deferred), 1 },
+    { "tasks_coalesced_total", "counter",
+      "Tasks coalesced with an identical task.",
+      offsetof(TSStats, tasks_coalesced), 1 },
+    { "tasks_invalid_total", "counter", "Tasks that failed validation.",
+      offsetof(TSStats, tasks_invalid), 1 },
+    { "tasks_failed_total", "counter", "Tasks and queue jobs that failed.",
+      offsetof(TSStats, tasks_failed), 1 },
+    { "queue_jobs_total", "counter", "Executed queue jobs.",
+      offsetof(TSStats, queue_jobs), 1 },
+    { "batch_chunks_total", "counter", "Executed chunks of batch tasks.",
+      offsetof(TSStats, batch_chunks), 1 },
+    { "overloaded_ticks_total", "counter",
+      "Checks while the server was overloaded.",
+      offsetof(TSStats, overloaded_ticks), 1 },
+    { "fanout_targets_total", "counter",
+      "Executed parts of fanout tasks.",
+      offsetof(TSStats, fanout_targets), 1 },
+    { "transactions_total", "counter",
+      "Transactions of scheduler workers and executors.",
+      offsetof(TSStats, transactions), 1 },
+    { "tick_seconds_total", "counter", "Time spent in worker checks.",
+      offsetof(TSStats, tick_us), 1e-6 },
+    { "due_tasks", "gauge", "Tasks due at the last check.",
+      offsetof(TSStats, due_tasks), 1 },
+    { "due_queue_jobs", "gauge", "Queue jobs due at the last check.",
+      offsetof(TSStats, due_queue_jobs), 1 },
+    { "tick_lag_seconds", "gauge",
+      "How late the last check started.",
+      offsetof(TSStats, tick_lag_us), 1e-6 },
+    { "tick_interval_seconds", "gauge",
+      "Chosen wait before the next check.",
+      offsetof(TSStats, tick_interval_ms), 1e-3 },
+    { "batch_size", "gauge", "Chosen task batch size.",
+      offsetof(TSStats, batch_size), 1 },
+    { "queue_batch_size", "gauge", "Chosen queue batch size.",
+      offsetof(TSStats, queue_batch_size), 1 },
+    { "active_backends", "gauge", "Active backends at the last check.",
+      offsetof(TSStats, active_backends), 1 },
+    { "lock_waits", "gauge", "Backends waiting for locks at the last check.",
+      offsetof(TSStats, lock_waits), 1 },
+    { "checkpoint_in_progress", "gauge",
+      "Whether a checkpoint was running at the last check.",
+      offsetof(TSStats, checkpoint_in_progress), 1 },
+    { "replication_lag_bytes", "gauge",
+      "Lag of the slowest replica at the last check.",
+      offsetof(TSStats, replication_lag), 1 },
+};
+
+
+static void
+AppendHistogram(StringInfo buf,
+                const char *name,
+                const char *help,
+                const TSHistogram *histogram)
+{
+    int64 cumulative = 0;
+
+    appendStringInfo(buf, "# HELP pg_tkach_scheduler_%s %s\n", name, help);
+    appendStringInfo(buf, "# TYPE pg_tkach_scheduler_%s histogram\n", name);
+
+    for (int i = 0; i < TS_HISTOGRAM_BUCKETS; i++)
+    {
+        cumulative += histogram->buckets[i];
+        appendStringInfo(buf,
+                         "pg_tkach_scheduler_%s_bucket{le=\"%g\"} " INT64_FORMAT
+                         "\n",
+                         name,
+                         histogramBounds[i] / 1000.0,
+                         cumulative);
+    }
+
+    appendStringInfo(buf,
+                     "pg_tkach_scheduler_%s_bucket{le=\"+Inf\"} " INT64_FORMAT
+                     "\n",
+                     name,
+                     histogram->count);
+    appendStringInfo(
+        buf, "pg_tkach_scheduler_%s_sum %g\n", name, histogram->sum_ms / 1000.0);
+    appendStringInfo(buf,
+                     "pg_tkach_scheduler_%s_count " INT64_FORMAT "\n",
+                     name,
+                     histogram->count);
+}
+
+
+/*
+ * метрики в текстовом формате Prometheus
+ * берутся только из общей памяти, таблицы задач не читаются
+ * счётчики и гистограммы общие, а сигналы нагрузки выводятся для
+ * каждого воркера с меткой shard
+ */
+static void
+BuildMetrics(StringInfo buf)
+{
+    TSStats stats;
+    TSStats shards[TS_MAX_SHARDS];
+
+    TSStatsRead(&stats, shards);
+
+    for (int i = 0; i < lengthof(metrics); i++)
+    {
+        const TSMetric *metric = &metrics[i];
+        bool isGauge = strcmp(metric->type, "gauge") == 0;
+
+        appendStringInfo(buf,
+                         "# HELP pg_tkach_scheduler_%s %s\n",
+                         metric->name,
+                         metric->help);
+        appendStringInfo(buf,
+                         "# TYPE pg_tkach_scheduler_%s %s\n",
+                         metric->name,
+                         metric->type);
+
+        for (int shard = 0; shard < (isGauge ? TS_MAX_SHARDS : 1); shard++)
+        {
+            const TSStats *source = isGauge ? &shards[shard] : &stats;
+            int64 value =
+                *(const int64 *)((const char *)source + metric->offset);
+            char label[32] = "";
+
+            if (isGauge)
+            {
+                // воркер еще не сделал ни одной итерации
+                if (source->ticks == 0)
+                    continue;
+                snprintf(label, sizeof(label), "{shard=\"%d\"}", shard);
+            }
+
+            if (metric->scale == 1)
+                appendStringInfo(buf,
+                                 "pg_tkach_scheduler_%s%s " INT64_FORMAT "\n",
+                                 metric->name,
+                                 label,
+                                 value);
+            else
+                appendStringInfo(buf,
+                                 "pg_tkach_scheduler_%s%s %g\n",
+                                 metric->name,
+                                 label,
+                                 (double)value * metric->scale);
+        }
+    }
+
+    AppendHistogram(buf,
+                    "dispatch_lag_seconds",
+                    "Delay between the due time and the start of a task.",
+                    &stats.dispatch_lag);
+    AppendHistogram(buf,
+                    "exec_duration_seconds",
+                    "Execution time of tasks and queue jobs.",
+                    &stats.exec_duration);
+    AppendHistogram(buf,
+                    "tick_duration_seconds",
+                    "Duration of worker checks.",
+                    &stats.tick_duration);
+}
+
+
+/*
+ * записать метрики в файл TS_METRICS_FILE в каталоге данных
+ * файл заменяется переименованием, так что читатель не увидит его
+ * недописанным
+ */
+void
+TSMetricsWriteFile(void)
+{
+    StringInfoData buf;
+    const char *tmpPath = TS_METRICS_FILE ".tmp";
+
+    initStringInfo(&buf);
+    BuildMetrics(&buf);
+
+    FILE *file = AllocateFile(tmpPath, PG_BINARY_W);
+    if (file == NULL || fwrite(buf.data, buf.len, 1, file) != 1)
+    {
+        ereport(LOG,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", tmpPath)));
+        if (file != NULL)
+            FreeFile(file);
+        pfree(buf.data);
+        return;
+    }
+
+    if (FreeFile(file) || rename(tmpPath, TS_METRICS_FILE) != 0)
+        ereport(LOG,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", TS_METRICS_FILE)));
+
+    pfree(buf.data);
+}
+
+
+/*
+ * ts_metrics_text - метрики планировщика в формате Prometheus
+ */
+Datum
+ts_metrics_text(PG_FUNCTION_ARGS)
+{
+    if (tsShared == NULL)
+        elog(ERROR, "pg_tkach_scheduler not found in shared_preload_libraries");
+
+    StringInfoData buf;
+    initStringInfo(&buf);
+    BuildMetrics(&buf);
+
+    PG_RETURN_TEXT_P(cstring_to_text_with_len(buf.data, buf.len));
+}
@@ -0,0 +1,359 @@
+/* src/ts_queue.c */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "access/xact.h"
+#include "catalog/pg_type_d.h"
+#include "executor/spi.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "storage/lwlock.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+#include "task.h"
+#include "ts_background_worker.h"
+#include "ts_clock.h"
+#include "ts_executor.h"
+#include "ts_queue.h"
+#include "ts_stats.h"
+
+int queue_batch_size = 10000;
+int queue_lookback = 300;         // с
+int queue_retention = 3600;       // с
+int queue_partitions_ahead = 24;  // часов
+int queue_max_parallel = 4;
+bool queue_single = false;
+
+// все задачи очереди раньше этого момента уже выбраны воркером,
+// поэтому выборка не просматривает старые секции
+static TimestampTz queueWatermark = DT_NOBEGIN;
+
+// время последнего обслуживания секций
+static TimestampTz lastMaintain = 0;
+
+
+/*
+ * показать отметку воркера остальным, секции очереди удаляет
+ * воркер шарда 0 по самой ранней отметке
+ */
+static void
+PublishWatermark(int shard)
+{
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+    tsShared->queue_watermark[shard] = queueWatermark;
+    LWLockRelease(tsShared->lock);
+}
+
+
+/*
+ * до какого времени очередь выбрана всеми воркерами
+ * DT_NOBEGIN, пока хотя бы один воркер не выбрал её до конца
+ */
+static TimestampTz
+MinWatermark(void)
+{
+    TimestampTz watermark = DT_NOEND;
+
+    LWLockAcquire(tsShared->lock, LW_SHARED);
+    for (int shard = 0; shard < num_shards; shard++)
+        watermark = Min(watermark, tsShared->queue_watermark[shard]);
+    LWLockRelease(tsShared->lock);
+
+    return watermark;
+}
+
+
+/*
+ * выбрать из очереди до limit невыполненных задач,
+ * время которых наступило
+ */
+static int
+FetchQueueJobs(TimestampTz now, int shard, int limit, Task **jobs)
+{
+    MemoryContext jobsContext = CurrentMemoryContext;
+    int count = 0;
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "failed to connect to SPI");
+
+    const char *sql;
+    sql = "SELECT q.job_id, q.time_exec, q.command, q.username, q.database "
+          "FROM ts.queue q "
+          "WHERE q.time_exec <= $1 AND q.time_exec >= $2 "
+          "AND NOT EXISTS (SELECT 1 FROM ts.queue_done d "
+          "WHERE d.time_exec = q.time_exec AND d.job_id = q.job_id)";
+
+    if (num_shards > 1)
+        sql = psprintf(
+            "%s AND %s = %d", sql, ShardExpression("q.job_id"), shard);
+
+    sql = psprintf("%s ORDER BY q.time_exec LIMIT $3", sql);
+
+    Datum argValues[3];
+    Oid argTypes[3] = { TIMESTAMPTZOID, TIMESTAMPTZOID, INT4OID };
+
+    argValues[0] = TimestampTzGetDatum(now);
+    argValues[1] = TimestampTzGetDatum(queueWatermark);
+    argValues[2] = Int32GetDatum(limit);
+
+    if (SPI_execute_with_args(sql, 3, argTypes, argValues, NULL, true, 0) !=
+        SPI_OK_SELECT)
+        elog(ERROR, "SPI_exec failed while selecting queue jobs");
+
+    SPITupleTable *tuptable = SPI_tuptable;
+    TupleDesc tupdesc = tuptable->tupdesc;
+    count = SPI_processed;
+
+    MemoryContext oldcontext = MemoryContextSwitchTo(jobsContext);
+
+    *jobs = palloc0(sizeof(Task) * Max(count, 1));
+    for (int i = 0; i < count; i++)
+    {
+        HeapTuple tuple = tuptable->vals[i];
+        Task *job = &(*jobs)[i];
+        bool isnull;
+
+        job->task_id = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+        job->time_next_exec =
+            DatumGetTimestampTz(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+        job->command =
+            TextDatumGetCString(SPI_getbinval(tuple, tupdesc, 3, &isnull));
+        job->username =
+            TextDatumGetCString(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+        job->database =
+            TextDatumGetCString(SPI_getbinval(tuple, tupdesc, 5, &isnull));
+        job->type = Single;
+        job->func = InvalidOid;
+        job->validated = true;
+        job->queue_job = true;
+    }
+
+    MemoryContextSwitchTo(oldcontext);
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    MemoryContextSwitchTo(jobsContext);
+    return count;
+}
+
+
+/*
+ * отметить выполненные задачи очереди одной вставкой
+ */
+static void
+MarkQueueJobsDone(Task *jobs, bool *ok, int count)
+{
+    Datum *ids = palloc(sizeof(Datum) * count);
+    Datum *times = palloc(sizeof(Datum) * count);
+    Datum *oks = palloc(sizeof(Datum) * count);
+
+    for (int i = 0; i < count; i++)
+    {
+        ids[i] = Int64GetDatum(jobs[i].task_id);
+        times[i] = TimestampTzGetDatum(jobs[i].time_next_exec);
+        oks[i] = BoolGetDatum(ok[i]);
+    }
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "failed to connect to SPI");
+
+    Datum argValues[3];
+    Oid argTypes[3] = { INT8ARRAYOID, TIMESTAMPTZARRAYOID, BOOLARRAYOID };
+
+    argValues[0] = PointerGetDatum(construct_array(
+        ids, count, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+    argValues[1] = PointerGetDatum(construct_array(times,
+                                                   count,
+                                                   TIMESTAMPTZOID,
+                                                   sizeof(TimestampTz),
+                                                   FLOAT8PASSBYVAL,
+                                                   TYPALIGN_DOUBLE));
+    argValues[2] = PointerGetDatum(construct_array(
+        oks, count, BOOLOID, sizeof(bool), true, TYPALIGN_CHAR));
+
+    if (SPI_execute_with_args(
+            "INSERT INTO ts.queue_done (job_id, time_exec, ok) "
+            "SELECT * FROM unnest($1::BIGINT[], $2::TIMESTAMPTZ[], "
+            "$3::BOOLEAN[]);",
+            3,
+            argTypes,
+            argValues,
+            NULL,
+            false,
+            0) != SPI_OK_INSERT)
+        elog(ERROR, "SPI_exec failed witch insert queue_done");
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+}
+
+
+/*
+ * выполнить до limit задач очереди, время которых наступило
+ * каждая задача выполняется в своей транзакции, на исполнителях - до
+ * queue_max_parallel задач одновременно, отметки о выполнении
+ * вставляются одной транзакцией на всю выборку; если воркер упадет
+ * между ними, задачи выполнятся повторно
+ * возвращает true, если в очереди остались готовые к выполнению задачи
+ */
+bool
+TSQueueProcess(TimestampTz now, int shard, int limit, TSStats *stats)
+{
+    elog(DEBUG1, "pg_tkach_scheduler start TSQueueProcess");
+
+    MemoryContext queueContext =
+        AllocSetContextCreate(TopMemoryContext,
+                              "pg_tkach_scheduler queue",
+                              ALLOCSET_DEFAULT_SIZES);
+    MemoryContext oldcontext = MemoryContextSwitchTo(queueContext);
+
+    Task *jobs;
+    int count = FetchQueueJobs(now, shard, limit, &jobs);
+    bool *ok = palloc(sizeof(bool) * Max(count, 1));
+
+    stats->due_queue_jobs = count;
+
+    TimestampTz dispatchTime = TSNow();
+    for (int i = 0; i < count; i++)
+        TSHistogramObserve(
+            &stats->dispatch_lag,
+            (double)(dispatchTime - jobs[i].time_next_exec) / 1000.0);
+
+    if (max_executors > 0)
+    {
+        // задачи выполняются параллельно, каждая на исполнителе
+        // своего пользователя и базы данных
+        if (count > 0)
+            TSExecutorRunAll(
+                jobs, count, Min(queue_max_parallel, max_executors), ok);
+    }
+    else
+    {
+        for (int i = 0; i < count; i++)
+        {
+            TimestampTz startTime = GetCurrentTimestamp();
+
+            // ошибка задачи отмечается в ts.queue_done, а не
+            // останавливает воркер, иначе он падал бы на ней снова
+            uint64 processed;
+            ok[i] = ExecuteTaskInWorker(&jobs[i], &processed);
+
+            jobs[i].exec_time =
+                (double)(GetCurrentTimestamp() - startTime) / 1000.0;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        TSHistogramObserve(&stats->exec_duration, jobs[i].exec_time);
+
+        stats->queue_jobs++;
+        if (!ok[i])
+            stats->tasks_failed++;
+    }
+
+    if (count > 0)
+        MarkQueueJobsDone(jobs, ok, count);
+
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextDelete(queueContext);
+
+    // очередь до now выбрана полностью: задачи раньше now - queue_lookback
+    // уже не появятся, если транзакции, добавляющие их, короче queue_lookback
+    bool backlog = count >= limit;
+    if (!backlog)
+    {
+        TimestampTz watermark = now - (int64)queue_lookback * USECS_PER_SEC;
+        if (watermark > queueWatermark)
+        {
+            queueWatermark = watermark;
+            PublishWatermark(shard);
+        }
+    }
+
+    elog(DEBUG1, "pg_tkach_scheduler end TSQueueProcess: %d jobs", count);
+    return backlog;
+}
+
+
+/*
+ * создать часовые секции очереди наперед и удалить старые
+ * выполняется не чаще раза в минуту
+ */
+void
+TSQueueMaintain(TimestampTz now)
+{
+    if (lastMaintain != 0 && now >= lastMaintain &&
+        now - lastMaintain < USECS_PER_MINUTE)
+        return;
+
+    lastMaintain = now;
+
+    elog(DEBUG1, "pg_tkach_scheduler start TSQueueMaintain");
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "failed to connect to SPI");
+
+    Datum argValues[3];
+    Oid argTypes[3] = { TIMESTAMPTZOID, INT4OID, TIMESTAMPTZOID };
+    char argNulls[3] = { ' ', ' ', ' ' };
+
+    argValues[0] = TimestampTzGetDatum(now);
+    argValues[1] = Int32GetDatum(queue_partitions_ahead);
+
+    // каждый воркер выбирает свой шард очереди, поэтому старые секции
+    // удаляются, только когда их выбрали все воркеры; пока хотя бы один
+    // не выбрал очередь до конца, секции не удаляются
+    TimestampTz watermark = MinWatermark();
+    if (TIMESTAMP_IS_NOBEGIN(watermark))
+        argNulls[2] = 'n';
+    else
+        argValues[2] = TimestampTzGetDatum(
+            watermark - (int64)queue_retention * USECS_PER_SEC);
+
+    if (SPI_execute_with_args("SELECT ts.queue_maintain($1, $2, $3);",
+                              3,
+                              argTypes,
+                              argValues,
+                              argNulls,
+                              false,
+                              0) != SPI_OK_SELECT)
+        elog(ERROR, "SPI_exec failed witch queue maintenance");
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    elog(DEBUG1, "pg_tkach_scheduler end TSQueueMaintain");
+}
+
+
+/*
+ * до какого времени очередь уже выбрана, сохраняется в снимке воркера
+ */
+TimestampTz
+TSQueueWatermark(void)
+{
+    return queueWatermark;
+}
+
+
+void
+TSQueueRestoreWatermark(int shard, TimestampTz watermark)
+{
+    queueWatermark = watermark;
+    PublishWatermark(shard);
+}
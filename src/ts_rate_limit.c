@@ -0,0 +1,128 @@
+/* src/ts_rate_limit.c */
+
+#include "postgres.h"
+#include "storage/lwlock.h"
+#include "utils/elog.h"
+
+#include "ts_rate_limit.h"
+#include "ts_shmem.h"
+
+
+/*
+ * успел ли bucket пополниться до полного запаса
+ * такой bucket не отличается от bucket новой группы, поэтому его можно
+ * отдать другой группе; так освобождаются места групп, удаленных
+ * из ts.rate_limit или больше не используемых задачами
+ */
+static bool
+RateBucketFull(const TSRateBucket *bucket, TimestampTz now)
+{
+    double elapsed =
+        now > bucket->last_refill
+            ? (double)(now - bucket->last_refill) / USECS_PER_SEC
+            : 0;
+
+    return bucket->tokens + bucket->rate * elapsed >= bucket->burst;
+}
+
+
+/*
+ * найти bucket группы или занять свободный
+ * вызывается под эксклюзивной блокировкой tsShared->lock
+ */
+static TSRateBucket *
+FindRateBucket(const char *group, double burst, TimestampTz now)
+{
+    TSRateBucket *freeBucket = NULL;
+    TSRateBucket *fullBucket = NULL;
+
+    for (int i = 0; i < tsShared->num_rate_buckets; i++)
+    {
+        TSRateBucket *bucket = &tsShared->rate_buckets[i];
+
+        if (!bucket->in_use)
+        {
+            if (freeBucket == NULL)
+                freeBucket = bucket;
+            continue;
+        }
+
+        // имя в bucket обрезано до NAMEDATALEN, как и при сохранении
+        if (strncmp(bucket->group_name, group, NAMEDATALEN - 1) == 0)
+            return bucket;
+
+        if (fullBucket == NULL && RateBucketFull(bucket, now))
+            fullBucket = bucket;
+    }
+
+    if (freeBucket == NULL)
+        freeBucket = fullBucket;
+
+    // новая группа начинает с полным запасом токенов
+    if (freeBucket != NULL)
+    {
+        freeBucket->in_use = true;
+        strlcpy(freeBucket->group_name, group, NAMEDATALEN);
+        freeBucket->tokens = burst;
+        freeBucket->last_refill = now;
+    }
+
+    return freeBucket;
+}
+
+
+/*
+ * взять токен из группы ограничения частоты
+ * rate - токенов в секунду, burst - максимальный запас токенов
+ * возвращает false, если токена нет и задачу нужно отложить,
+ * тогда retryAt - момент, когда токен появится
+ */
+bool
+TSRateLimitAcquire(const char *group,
+                   double rate,
+                   double burst,
+                   TimestampTz now,
+                   TimestampTz *retryAt)
+{
+    bool acquired = false;
+
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+
+    TSRateBucket *bucket = FindRateBucket(group, burst, now);
+
+    if (bucket == NULL)
+    {
+        // групп больше, чем max_rate_groups - не ограничиваем,
+        // лучше выполнить задачу, чем никогда её не выполнить
+        LWLockRelease(tsShared->lock);
+        elog(WARNING,
+             "pg_tkach_scheduler: too many rate limit groups, "
+             "group \"%s\" is not limited",
+             group);
+        return true;
+    }
+
+    bucket->rate = rate;
+    bucket->burst = burst;
+
+    // пополняем токены за прошедшее время
+    if (now > bucket->last_refill)
+    {
+        double elapsed = (double)(now - bucket->last_refill) / USECS_PER_SEC;
+        bucket->tokens = Min(burst, bucket->tokens + rate * elapsed);
+        bucket->last_refill = now;
+    }
+
+    if (bucket->tokens >= 1.0)
+    {
+        bucket->tokens -= 1.0;
+        acquired = true;
+    }
+    else
+        *retryAt = now + (TimestampTz)((1.0 - bucket->tokens) / rate *
+                                       USECS_PER_SEC) + 1;
+
+    LWLockRelease(tsShared->lock);
+
+    return acquired;
+}
@@ -0,0 +1,138 @@
+/* src/ts_settings.c */
+
+#include "postgres.h"
+#include "miscadmin.h"
+
+#include "utils/guc.h"
+#include "utils/varlena.h"
+
+#include "ts_settings.h"
+
+// параметры, которые можно задать задаче, через запятую
+char *task_settings_allowlist = NULL;
+
+
+/*
+ * разделить настройку задачи вида name=value на имя и значение
+ */
+static void
+SplitSetting(const char *setting, char **name, char **value)
+{
+    if (setting == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("task setting must be NOT NULL")));
+
+    const char *eq = strchr(setting, '=');
+    if (eq == NULL || eq == setting)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid task setting \"%s\"", setting),
+                 errhint("Task settings must have the form name=value.")));
+
+    *name = pnstrdup(setting, eq - setting);
+    *value = pstrdup(eq + 1);
+}
+
+
+/*
+ * разрешено ли задавать параметр задаче
+ */
+static bool
+SettingAllowed(const char *name)
+{
+    char *rawstring = pstrdup(task_settings_allowlist);
+    List *names;
+    ListCell *cell;
+    bool allowed = false;
+
+    if (!SplitIdentifierString(rawstring, ',', &names))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid list syntax in "
+                        "pg_tkach_scheduler.task_settings_allowlist")));
+
+    foreach (cell, names)
+    {
+        if (pg_strcasecmp((char *)lfirst(cell), name) == 0)
+        {
+            allowed = true;
+            break;
+        }
+    }
+
+    list_free(names);
+    pfree(rawstring);
+
+    return allowed;
+}
+
+
+/*
+ * проверить настройки задачи при планировании: параметр должен быть
+ * в task_settings_allowlist, а значение - допустимым для текущего
+ * пользователя, сами параметры при этом не меняются
+ */
+void
+TSSettingsCheck(char **settings, int nsettings)
+{
+    GucContext context = superuser() ? PGC_SUSET : PGC_USERSET;
+
+    for (int i = 0; i < nsettings; i++)
+    {
+        char *name;
+        char *value;
+
+        SplitSetting(settings[i], &name, &value);
+
+        if (!SettingAllowed(name))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                     errmsg("parameter \"%s\" cannot be set for a task", name),
+                     errhint("Allowed parameters are listed in "
+                             "pg_tkach_scheduler.task_settings_allowlist.")));
+
+        (void)set_config_option(name,
+                                value,
+                                context,
+                                PGC_S_SESSION,
+                                GUC_ACTION_LOCAL,
+                                false,
+                                ERROR,
+                                false);
+
+        pfree(name);
+        pfree(value);
+    }
+}
+
+
+/*
+ * применить настройки задачи до конца текущей транзакции,
+ * как SET LOCAL, поэтому они не влияют на следующие задачи
+ */
+void
+TSSettingsApply(char **settings, int nsettings)
+{
+    GucContext context = superuser() ? PGC_SUSET : PGC_USERSET;
+
+    for (int i = 0; i < nsettings; i++)
+    {
+        char *name;
+        char *value;
+
+        SplitSetting(settings[i], &name, &value);
+
+        (void)set_config_option(name,
+                                value,
+                                context,
+                                PGC_S_SESSION,
+                                GUC_ACTION_LOCAL,
+                                true,
+                                ERROR,
+                                false);
+
+        pfree(name);
+        pfree(value);
+    }
+}
@@ -0,0 +1,114 @@
+/* src/ts_shmem.c */
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+#include "ts_executor.h"
+#include "ts_shmem.h"
+#include "ts_snapshot.h"
+#include "ts_task_usage.h"
+
+int max_rate_groups = 64;
+
+TSSharedState *tsShared = NULL;
+
+static shmem_startup_hook_type prevShmemStartupHook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prevShmemRequestHook = NULL;
+#endif
+
+
+/*
+ * размер структуры TSSharedState
+ */
+static Size
+TSSharedStateSize(void)
+{
+    return add_size(offsetof(TSSharedState, rate_buckets),
+                    mul_size(max_rate_groups, sizeof(TSRateBucket)));
+}
+
+
+/*
+ * размер общей памяти планировщика
+ */
+static Size
+TSShmemSize(void)
+{
+    Size size = add_size(TSSharedStateSize(), TSTaskUsageShmemSize());
+
+    return add_size(size, TSExecutorShmemSize());
+}
+
+
+/*
+ * запросить общую память и lwlock у postmaster-а
+ */
+static void
+TSShmemRequest(void)
+{
+#if PG_VERSION_NUM >= 150000
+    if (prevShmemRequestHook)
+        prevShmemRequestHook();
+#endif
+
+    RequestAddinShmemSpace(TSShmemSize());
+    RequestNamedLWLockTranche("pg_tkach_scheduler", 1);
+    RequestNamedLWLockTranche(TS_TASK_USAGE_TRANCHE, 1);
+}
+
+
+/*
+ * выделить и проинициализировать общую память
+ */
+static void
+TSShmemStartup(void)
+{
+    bool found;
+
+    if (prevShmemStartupHook)
+        prevShmemStartupHook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    tsShared = ShmemInitStruct("pg_tkach_scheduler", TSSharedStateSize(), &found);
+    if (!found)
+    {
+        memset(tsShared, 0, TSSharedStateSize());
+        tsShared->lock = &(GetNamedLWLockTranche("pg_tkach_scheduler"))->lock;
+        tsShared->num_rate_buckets = max_rate_groups;
+        pg_atomic_init_u64(&tsShared->executor_transactions, 0);
+        for (int shard = 0; shard < TS_MAX_SHARDS; shard++)
+            TIMESTAMP_NOBEGIN(tsShared->queue_watermark[shard]);
+
+        // общая память создана заново: сервер запущен или перезапущен
+        // после сбоя, воркеры еще не работают
+        TSSnapshotRestoreShared();
+    }
+
+    TSTaskUsageShmemInit();
+    TSExecutorShmemInit();
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * установить хуки общей памяти, вызывается из _PG_init
+ */
+void
+TSShmemInit(void)
+{
+#if PG_VERSION_NUM >= 150000
+    prevShmemRequestHook = shmem_request_hook;
+    shmem_request_hook = TSShmemRequest;
+#else
+    TSShmemRequest();
+#endif
+
+    prevShmemStartupHook = shmem_startup_hook;
+    shmem_startup_hook = TSShmemStartup;
+}
@@ -0,0 +1,453 @@
+/* src/ts_snapshot.c */
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include <sys/stat.h>
+
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/pg_type_d.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
+#include "storage/lwlock.h"
+#include "utils/array.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+#include "task.h"
+#include "ts_background_worker.h"
+#include "ts_shmem.h"
+#include "ts_snapshot.h"
+
+int snapshot_interval = 60; // с
+
+#define TS_SNAPSHOT_MAGIC 0x54534e50 // "TSNP"
+#define TS_SNAPSHOT_VERSION 2
+
+
+/*
+ * заголовок файла снимка
+ * по нему снимок проверяется перед загрузкой: снимок другого кластера,
+ * базы, пересозданной таблицы или из будущего (после восстановления
+ * из резервной копии) не используется
+ */
+typedef struct TSSnapshotHeader
+{
+    uint32 magic;
+    uint32 version;
+    uint64 system_identifier;
+    Oid database;
+    Oid schedule_filenode; // relfilenode ts.task_schedule
+    XLogRecPtr lsn;        // позиция WAL в момент записи
+    int32 shard;
+    int32 num_shards;
+    TimestampTz written_at;
+    uint32 stats_size;     // sizeof(TSStats), 0 - статистики нет
+    int32 num_buckets;
+    int32 num_tasks;
+    TSWorkerState state;
+    uint32 body_size;
+    pg_crc32c body_crc;
+} TSSnapshotHeader;
+
+
+/*
+ * задача из снимка
+ */
+typedef struct TSSnapshotTask
+{
+    int64 task_id;
+    TimestampTz time_next_exec;
+} TSSnapshotTask;
+
+
+static char *
+SnapshotPath(int shard)
+{
+    return psprintf(PG_STAT_PERMANENT_DIRECTORY "/pg_tkach_scheduler.%d.snapshot",
+                    shard);
+}
+
+
+/*
+ * relfilenode ts.task_schedule, вызывается в транзакции с SPI
+ */
+static Oid
+GetScheduleFilenode(void)
+{
+    if (SPI_execute("SELECT pg_relation_filenode(to_regclass('ts.task_schedule'))", true, 1) !=
+        SPI_OK_SELECT)
+        elog(ERROR, "SPI_exec failed while getting ts.task_schedule filenode");
+
+    bool isnull;
+    Datum filenode = SPI_getbinval(
+        SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+    return isnull ? InvalidOid : DatumGetObjectId(filenode);
+}
+
+
+/*
+ * записать файл снимка шарда
+ * файл сначала пишется во временный и затем атомарно переименовывается
+ */
+static void
+WriteSnapshotFile(int shard, const TSSnapshotHeader *header, const char *body)
+{
+    char *path = SnapshotPath(shard);
+    char *tmpPath = psprintf("%s.tmp", path);
+
+    FILE *file = AllocateFile(tmpPath, PG_BINARY_W);
+    if (file == NULL ||
+        fwrite(header, sizeof(TSSnapshotHeader), 1, file) != 1 ||
+        (header->body_size > 0 &&
+         fwrite(body, header->body_size, 1, file) != 1))
+    {
+        ereport(LOG,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", tmpPath)));
+        if (file != NULL)
+            FreeFile(file);
+        unlink(tmpPath);
+        return;
+    }
+
+    if (FreeFile(file))
+    {
+        ereport(LOG,
+                (errcode_for_file_access(),
+                 errmsg("could not close file \"%s\": %m", tmpPath)));
+        unlink(tmpPath);
+        return;
+    }
+
+    // durable_rename синхронизирует файл и каталог
+    (void)durable_rename(tmpPath, path, LOG);
+
+    pfree(tmpPath);
+    pfree(path);
+}
+
+
+/*
+ * переписать снимок шарда 0 без статистики и групп ограничения частоты
+ * после того, как они восстановлены или устарели: иначе после сбоя
+ * общая память снова заполнилась бы ими, и счётчики ушли бы назад
+ */
+static void
+DropSnapshotStats(const TSSnapshotHeader *header, const char *body)
+{
+    TSSnapshotHeader stripped = *header;
+    uint32 statsLen =
+        header->stats_size + sizeof(TSRateBucket) * header->num_buckets;
+
+    stripped.stats_size = 0;
+    stripped.num_buckets = 0;
+    stripped.body_size = header->body_size - statsLen;
+    INIT_CRC32C(stripped.body_crc);
+    COMP_CRC32C(stripped.body_crc, body + statsLen, stripped.body_size);
+    FIN_CRC32C(stripped.body_crc);
+
+    WriteSnapshotFile(0, &stripped, body + statsLen);
+}
+
+
+/*
+ * записать снимок состояния воркера
+ * в снимок попадают ближайшие задачи шарда и состояние воркера,
+ * а в снимок шарда 0 при остановке (shutdown) еще статистика и состояние
+ * групп ограничения частоты; в периодических снимках их нет, поэтому
+ * после сбоя общая память не заполняется устаревшими значениями
+ */
+void
+TSSnapshotWrite(int shard, const TSWorkerState *state, TimestampTz now,
+                bool shutdown)
+{
+    elog(DEBUG1, "pg_tkach_scheduler start TSSnapshotWrite");
+
+    TSSnapshotHeader header;
+    StringInfoData body;
+
+    memset(&header, 0, sizeof(TSSnapshotHeader));
+    header.magic = TS_SNAPSHOT_MAGIC;
+    header.version = TS_SNAPSHOT_VERSION;
+    header.system_identifier = GetSystemIdentifier();
+    header.database = MyDatabaseId;
+    header.shard = shard;
+    header.num_shards = num_shards;
+    header.written_at = GetCurrentTimestamp();
+    header.state = *state;
+
+    initStringInfo(&body);
+
+    // статистика и группы общие для всех воркеров, их сохраняет шард 0
+    if (shard == 0 && shutdown)
+    {
+        LWLockAcquire(tsShared->lock, LW_SHARED);
+        header.stats_size = sizeof(TSStats);
+        appendBinaryStringInfo(
+            &body, (const char *)&tsShared->stats, sizeof(TSStats));
+        header.num_buckets = tsShared->num_rate_buckets;
+        appendBinaryStringInfo(&body,
+                               (const char *)tsShared->rate_buckets,
+                               sizeof(TSRateBucket) * tsShared->num_rate_buckets);
+        LWLockRelease(tsShared->lock);
+    }
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "failed to connect to SPI");
+
+    header.schedule_filenode = GetScheduleFilenode();
+
+    // задачи, которые наступят до следующего снимка, с запасом
+    const char *sql;
+    sql = "SELECT s.task_id, s.time_next_exec FROM ts.task_schedule s "
+          "WHERE s.time_next_exec <= $1";
+    if (num_shards > 1)
+        sql = psprintf(
+            "%s AND %s = %d", sql, ShardExpression("s.task_id"), shard);
+    sql = psprintf("%s ORDER BY s.time_next_exec LIMIT %d",
+                   sql,
+                   TS_SNAPSHOT_MAX_TASKS);
+
+    Datum argValues[1];
+    Oid argTypes[1] = { TIMESTAMPTZOID };
+    argValues[0] = TimestampTzGetDatum(
+        now + (int64)Max(snapshot_interval, 60) * 2 * USECS_PER_SEC);
+
+    if (SPI_execute_with_args(sql, 1, argTypes, argValues, NULL, true, 0) !=
+        SPI_OK_SELECT)
+        elog(ERROR, "SPI_exec failed while selecting snapshot tasks");
+
+    header.num_tasks = SPI_processed;
+    for (uint64 i = 0; i < SPI_processed; i++)
+    {
+        HeapTuple tuple = SPI_tuptable->vals[i];
+        TupleDesc tupdesc = SPI_tuptable->tupdesc;
+        TSSnapshotTask task;
+        bool isnull;
+
+        task.task_id = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+        task.time_next_exec =
+            DatumGetTimestampTz(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+        appendBinaryStringInfo(&body, (const char *)&task, sizeof(task));
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    header.lsn = GetXLogInsertRecPtr();
+    header.body_size = body.len;
+    INIT_CRC32C(header.body_crc);
+    COMP_CRC32C(header.body_crc, body.data, body.len);
+    FIN_CRC32C(header.body_crc);
+
+    WriteSnapshotFile(shard, &header, body.data);
+
+    pfree(body.data);
+
+    elog(DEBUG1,
+         "pg_tkach_scheduler end TSSnapshotWrite: %d tasks",
+         header.num_tasks);
+}
+
+
+/*
+ * прочитать файл снимка шарда и проверить то, что не зависит от базы:
+ * формат, кластер, размер и контрольную сумму
+ * возвращает false, если снимка нет или он поврежден
+ */
+static bool
+ReadSnapshotFile(int shard, TSSnapshotHeader *header, char **body)
+{
+    char *path = SnapshotPath(shard);
+
+    *body = NULL;
+
+    FILE *file = AllocateFile(path, PG_BINARY_R);
+    if (file == NULL)
+    {
+        if (errno != ENOENT)
+            ereport(LOG,
+                    (errcode_for_file_access(),
+                     errmsg("could not read file \"%s\": %m", path)));
+        pfree(path);
+        return false;
+    }
+
+    bool ok = fread(header, sizeof(TSSnapshotHeader), 1, file) == 1 &&
+              header->magic == TS_SNAPSHOT_MAGIC &&
+              header->version == TS_SNAPSHOT_VERSION &&
+              header->system_identifier == GetSystemIdentifier() &&
+              header->shard == shard &&
+              header->body_size ==
+                  header->stats_size +
+                      (header->stats_size > 0
+                           ? sizeof(TSRateBucket) * header->num_buckets
+                           : 0) +
+                      sizeof(TSSnapshotTask) * header->num_tasks;
+
+    if (ok)
+    {
+        *body = palloc(Max(header->body_size, 1));
+        ok = header->body_size == 0 ||
+             fread(*body, header->body_size, 1, file) == 1;
+    }
+
+    FreeFile(file);
+
+    if (ok)
+    {
+        pg_crc32c crc;
+        INIT_CRC32C(crc);
+        COMP_CRC32C(crc, *body, header->body_size);
+        FIN_CRC32C(crc);
+        ok = EQ_CRC32C(crc, header->body_crc);
+    }
+
+    if (!ok)
+    {
+        ereport(LOG,
+                (errmsg("pg_tkach_scheduler ignores outdated snapshot \"%s\"",
+                        path)));
+        if (*body != NULL)
+            pfree(*body);
+        *body = NULL;
+    }
+
+    pfree(path);
+    return ok;
+}
+
+
+/*
+ * восстановить статистику и группы ограничения частоты из снимка шарда 0
+ * вызывается из shmem_startup_hook, когда общая память только что
+ * создана, то есть до запуска воркеров: ни один воркер еще не успел
+ * ничего посчитать, и восстановленное значение ничего не затирает
+ * статистика есть только в снимке, записанном при остановке, и после
+ * восстановления удаляется из него, поэтому при перезапуске после сбоя
+ * статистика начинается с нуля, а не со старого снимка
+ * позиция WAL и таблица здесь не проверяются, их не проверить до
+ * восстановления и подключения к базе, а статистика общая для кластера
+ */
+void
+TSSnapshotRestoreShared(void)
+{
+    TSSnapshotHeader header;
+    char *body;
+
+    if (!ReadSnapshotFile(0, &header, &body))
+        return;
+
+    if (header.stats_size == sizeof(TSStats))
+    {
+        memcpy(&tsShared->stats, body, sizeof(TSStats));
+
+        int numBuckets = Min(header.num_buckets, tsShared->num_rate_buckets);
+        memcpy(tsShared->rate_buckets,
+               body + header.stats_size,
+               sizeof(TSRateBucket) * numBuckets);
+
+        elog(LOG, "pg_tkach_scheduler restored statistics from snapshot");
+    }
+
+    if (header.stats_size > 0)
+        DropSnapshotStats(&header, body);
+
+    pfree(body);
+}
+
+
+/*
+ * прочитать снимок шарда
+ * восстанавливает состояние воркера, статистику и группы ограничения
+ * частоты восстанавливает TSSnapshotRestoreShared при старте сервера
+ * возвращает массив task_id ближайших задач (bigint[]) или NULL,
+ * если снимка нет или он не подходит
+ */
+ArrayType *
+TSSnapshotLoad(int shard, TSWorkerState *state)
+{
+    TSSnapshotHeader header;
+    char *body;
+    ArrayType *ids = NULL;
+
+    if (!ReadSnapshotFile(shard, &header, &body))
+        return NULL;
+
+    // воркер шарда 0 остановили без перезапуска сервера: статистика
+    // в общей памяти новее снимка, и восстанавливать её после сбоя нельзя
+    if (header.stats_size > 0)
+        DropSnapshotStats(&header, body);
+
+    bool ok = header.database == MyDatabaseId &&
+              header.num_shards == num_shards &&
+              header.lsn <= GetXLogInsertRecPtr();
+
+    // таблица могла быть пересоздана, пока воркер не работал
+    if (ok)
+    {
+        StartTransactionCommand();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        if (SPI_connect() != SPI_OK_CONNECT)
+            elog(ERROR, "failed to connect to SPI");
+
+        Oid filenode = GetScheduleFilenode();
+        ok = OidIsValid(filenode) && filenode == header.schedule_filenode;
+
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+    }
+
+    if (!ok)
+    {
+        ereport(LOG,
+                (errmsg("pg_tkach_scheduler ignores outdated snapshot of "
+                        "shard %d",
+                        shard)));
+        pfree(body);
+        return NULL;
+    }
+
+    *state = header.state;
+
+    // статистика и группы уже восстановлены при старте сервера
+    char *data = body;
+
+    if (header.stats_size > 0)
+        data += header.stats_size + sizeof(TSRateBucket) * header.num_buckets;
+
+    if (header.num_tasks > 0)
+    {
+        Datum *elems = palloc(sizeof(Datum) * header.num_tasks);
+        TSSnapshotTask *tasks = (TSSnapshotTask *)data;
+
+        for (int i = 0; i < header.num_tasks; i++)
+            elems[i] = Int64GetDatum(tasks[i].task_id);
+
+        ids = construct_array(elems,
+                              header.num_tasks,
+                              INT8OID,
+                              sizeof(int64),
+                              FLOAT8PASSBYVAL,
+                              TYPALIGN_DOUBLE);
+        pfree(elems);
+    }
+
+    elog(LOG,
+         "pg_tkach_scheduler loaded snapshot of shard %d with %d tasks",
+         shard,
+         header.num_tasks);
+
+    pfree(body);
+    return ids;
+}
@@ -0,0 +1,231 @@
+/* src/ts_stats.c */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "utils/builtins.h"
+#include "utils/tuplestore.h"
+
+#include "ts_shmem.h"
+#include "ts_stats.h"
+
+PG_FUNCTION_INFO_V1(ts_stats);
+
+
+static const double histogramBounds[TS_HISTOGRAM_BUCKETS] = TS_HISTOGRAM_BOUNDS;
+
+
+/*
+ * учесть в гистограмме значение ms
+ */
+void
+TSHistogramObserve(TSHistogram *histogram, double ms)
+{
+    for (int i = 0; i < TS_HISTOGRAM_BUCKETS; i++)
+    {
+        if (ms <= histogramBounds[i])
+        {
+            histogram->buckets[i]++;
+            break;
+        }
+    }
+
+    histogram->count++;
+    histogram->sum_ms += ms;
+}
+
+
+static void
+HistogramAdd(TSHistogram *to, const TSHistogram *from)
+{
+    for (int i = 0; i < TS_HISTOGRAM_BUCKETS; i++)
+        to->buckets[i] += from->buckets[i];
+
+    to->count += from->count;
+    to->sum_ms += from->sum_ms;
+}
+
+
+/*
+ * добавить статистику итерации воркера shard в общую память
+ */
+void
+TSStatsReport(int shard, const TSStats *tick)
+{
+    LWLockAcquire(tsShared->lock, LW_EXCLUSIVE);
+
+    TSStats *stats = &tsShared->stats;
+
+    stats->ticks += tick->ticks;
+    stats->tasks_executed += tick->tasks_executed;
+    stats->tasks_rate_limited += tick->tasks_rate_limited;
+    stats->tasks_admission_deferred += tick->tasks_admission_deferred;
+    stats->overloaded_ticks += tick->overloaded_ticks;
+    stats->batch_chunks += tick->batch_chunks;
+    stats->tasks_coalesced += tick->tasks_coalesced;
+    stats->tasks_invalid += tick->tasks_invalid;
+    stats->tasks_failed += tick->tasks_failed;
+    stats->queue_jobs += tick->queue_jobs;
+    stats->fanout_targets += tick->fanout_targets;
+    stats->transactions += tick->transactions;
+    stats->tick_us += tick->tick_us;
+
+    // исполнители считают транзакции без блокировки, переносим их здесь,
+    // чтобы они попали и в снимок статистики
+    stats->transactions +=
+        pg_atomic_exchange_u64(&tsShared->executor_transactions, 0);
+
+    HistogramAdd(&stats->dispatch_lag, &tick->dispatch_lag);
+    HistogramAdd(&stats->exec_duration, &tick->exec_duration);
+    HistogramAdd(&stats->tick_duration, &tick->tick_duration);
+
+    // сигналы нагрузки у каждого воркера свои
+    tsShared->shard_stats[shard] = *tick;
+
+    LWLockRelease(tsShared->lock);
+}
+
+
+/*
+ * прочитать статистику из общей памяти
+ * сигналы нагрузки в stats сводятся по воркерам: глубина очереди и
+ * размеры выборок складываются, остальные берутся максимальными
+ * если shards не NULL, в него копируется статистика каждого воркера,
+ * воркер, не сделавший ни одной итерации, имеет ticks = 0
+ */
+void
+TSStatsRead(TSStats *stats, TSStats *shards)
+{
+    LWLockAcquire(tsShared->lock, LW_SHARED);
+
+    *stats = tsShared->stats;
+    stats->transactions +=
+        pg_atomic_read_u64(&tsShared->executor_transactions);
+
+    stats->active_backends = 0;
+    stats->lock_waits = 0;
+    stats->checkpoint_in_progress = 0;
+    stats->replication_lag = 0;
+    stats->admission_check_us = 0;
+    stats->tick_lag_us = 0;
+    stats->tick_interval_ms = 0;
+    stats->batch_size = 0;
+    stats->queue_batch_size = 0;
+    stats->due_tasks = 0;
+    stats->due_queue_jobs = 0;
+
+    for (int i = 0; i < TS_MAX_SHARDS; i++)
+    {
+        const TSStats *shard = &tsShared->shard_stats[i];
+
+        if (shard->ticks == 0)
+            continue;
+
+        stats->active_backends =
+            Max(stats->active_backends, shard->active_backends);
+        stats->lock_waits = Max(stats->lock_waits, shard->lock_waits);
+        stats->checkpoint_in_progress =
+            Max(stats->checkpoint_in_progress, shard->checkpoint_in_progress);
+        stats->replication_lag =
+            Max(stats->replication_lag, shard->replication_lag);
+        stats->admission_check_us =
+            Max(stats->admission_check_us, shard->admission_check_us);
+        stats->tick_lag_us = Max(stats->tick_lag_us, shard->tick_lag_us);
+        stats->tick_interval_ms =
+            Max(stats->tick_interval_ms, shard->tick_interval_ms);
+        stats->batch_size += shard->batch_size;
+        stats->queue_batch_size += shard->queue_batch_size;
+        stats->due_tasks += shard->due_tasks;
+        stats->due_queue_jobs += shard->due_queue_jobs;
+    }
+
+    if (shards != NULL)
+        memcpy(shards, tsShared->shard_stats, sizeof(tsShared->shard_stats));
+
+    LWLockRelease(tsShared->lock);
+}
+
+
+static void
+PutStat(Tuplestorestate *tupstore, TupleDesc tupdesc, const char *name, int64 value)
+{
+    Datum values[2];
+    bool nulls[2] = { false, false };
+
+    values[0] = CStringGetTextDatum(name);
+    values[1] = Int64GetDatum(value);
+
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+
+/*
+ * ts_stats - статистика планировщика в виде пар (name, value)
+ */
+Datum
+ts_stats(PG_FUNCTION_ARGS)
+{
+    if (tsShared == NULL)
+        elog(ERROR, "pg_tkach_scheduler not found in shared_preload_libraries");
+
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+        !(rsinfo->allowedModes & SFRM_Materialize))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("set-valued function called in context that cannot "
+                        "accept a set")));
+
+    MemoryContext oldcontext =
+        MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+    TupleDesc tupdesc;
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    Tuplestorestate *tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+
+    MemoryContextSwitchTo(oldcontext);
+
+    // копируем статистику, чтобы не держать блокировку во время вывода
+    TSStats stats;
+    TSStatsRead(&stats, NULL);
+
+    PutStat(tupstore, tupdesc, "ticks", stats.ticks);
+    PutStat(tupstore, tupdesc, "tasks_executed", stats.tasks_executed);
+    PutStat(tupstore, tupdesc, "tasks_rate_limited", stats.tasks_rate_limited);
+    PutStat(tupstore,
+            tupdesc,
+            "tasks_admission_deferred",
+            stats.tasks_admission_deferred);
+    PutStat(tupstore, tupdesc, "overloaded_ticks", stats.overloaded_ticks);
+    PutStat(tupstore, tupdesc, "batch_chunks", stats.batch_chunks);
+    PutStat(tupstore, tupdesc, "tasks_coalesced", stats.tasks_coalesced);
+    PutStat(tupstore, tupdesc, "tasks_invalid", stats.tasks_invalid);
+    PutStat(tupstore, tupdesc, "tasks_failed", stats.tasks_failed);
+    PutStat(tupstore, tupdesc, "queue_jobs", stats.queue_jobs);
+    PutStat(tupstore, tupdesc, "fanout_targets", stats.fanout_targets);
+    PutStat(tupstore, tupdesc, "transactions", stats.transactions);
+    PutStat(tupstore, tupdesc, "tick_us", stats.tick_us);
+    PutStat(tupstore, tupdesc, "active_backends", stats.active_backends);
+    PutStat(tupstore, tupdesc, "lock_waits", stats.lock_waits);
+    PutStat(tupstore,
+            tupdesc,
+            "checkpoint_in_progress",
+            stats.checkpoint_in_progress);
+    PutStat(tupstore, tupdesc, "replication_lag", stats.replication_lag);
+    PutStat(tupstore, tupdesc, "admission_check_us", stats.admission_check_us);
+    PutStat(tupstore, tupdesc, "tick_lag_us", stats.tick_lag_us);
+    PutStat(tupstore, tupdesc, "tick_interval_ms", stats.tick_interval_ms);
+    PutStat(tupstore, tupdesc, "batch_size", stats.batch_size);
+    PutStat(tupstore, tupdesc, "queue_batch_size", stats.queue_batch_size);
+    PutStat(tupstore, tupdesc, "due_tasks", stats.due_tasks);
+    PutStat(tupstore, tupdesc, "due_queue_jobs", stats.due_queue_jobs);
+
+    return (Datum)0;
+}
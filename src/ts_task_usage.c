@@ -0,0 +1,245 @@
+/* src/ts_task_usage.c */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+
+#include "ts_task_usage.h"
+
+PG_FUNCTION_INFO_V1(ts_task_usage);
+
+int max_tracked_tasks = 1000;
+
+// ресурсы задач, max_tracked_tasks слотов
+static TSTaskUsageState *tsTaskUsageState = NULL;
+
+// номер слота по task_id, защищена tsTaskUsageState->lock
+static HTAB *tsTaskUsage = NULL;
+
+
+/*
+ * элемент хеш-таблицы: слот задачи
+ */
+typedef struct TSTaskUsageSlot
+{
+    int64 task_id; // ключ
+    int slot;
+} TSTaskUsageSlot;
+
+
+/*
+ * размер слотов
+ */
+static Size
+TSTaskUsageStateSize(void)
+{
+    return add_size(offsetof(TSTaskUsageState, entries),
+                    mul_size(max_tracked_tasks, sizeof(TSTaskUsage)));
+}
+
+
+/*
+ * размер слотов и хеш-таблицы в общей памяти
+ */
+Size
+TSTaskUsageShmemSize(void)
+{
+    // новая задача попадает в хеш-таблицу до вытеснения старой
+    return add_size(TSTaskUsageStateSize(),
+                    hash_estimate_size(max_tracked_tasks + 1,
+                                       sizeof(TSTaskUsageSlot)));
+}
+
+
+/*
+ * создать или подключить слоты и хеш-таблицу, вызывается из
+ * shmem_startup_hook под AddinShmemInitLock
+ */
+void
+TSTaskUsageShmemInit(void)
+{
+    HASHCTL ctl;
+    bool found;
+
+    tsTaskUsageState = ShmemInitStruct("pg_tkach_scheduler task usage slots",
+                                       TSTaskUsageStateSize(),
+                                       &found);
+    if (!found)
+    {
+        memset(tsTaskUsageState, 0, TSTaskUsageStateSize());
+        tsTaskUsageState->lock =
+            &(GetNamedLWLockTranche(TS_TASK_USAGE_TRANCHE))->lock;
+    }
+
+    ctl.keysize = sizeof(int64);
+    ctl.entrysize = sizeof(TSTaskUsageSlot);
+
+    tsTaskUsage = ShmemInitHash("pg_tkach_scheduler task usage",
+                                max_tracked_tasks + 1,
+                                max_tracked_tasks + 1,
+                                &ctl,
+                                HASH_ELEM | HASH_BLOBS);
+}
+
+
+/*
+ * выбрать слот под новую задачу: свободный или вытесненный часами,
+ * как буферы в shared_buffers - стрелка уменьшает счетчики обращений,
+ * пока не найдет слот с нулем, так что вытесняются давно не
+ * выполнявшиеся задачи, а часто выполняемые остаются
+ * вызывается под эксклюзивной блокировкой tsTaskUsageState->lock
+ */
+static int
+GetTaskUsageSlot(void)
+{
+    TSTaskUsageState *state = tsTaskUsageState;
+
+    if (state->num_used < max_tracked_tasks)
+        return state->num_used++;
+
+    for (;;)
+    {
+        int slot = state->clock_hand;
+        TSTaskUsage *entry = &state->entries[slot];
+
+        state->clock_hand = (slot + 1) % max_tracked_tasks;
+
+        if (entry->usage_count > 0)
+        {
+            entry->usage_count--;
+            continue;
+        }
+
+        hash_search(tsTaskUsage, &entry->task_id, HASH_REMOVE, NULL);
+        return slot;
+    }
+}
+
+
+/*
+ * добавить ресурсы одного выполнения задачи
+ * userTime и systemTime - процессорное время в миллисекундах
+ */
+void
+TSTaskUsageReport(int64 taskId,
+                  const BufferUsage *buffers,
+                  const WalUsage *wal,
+                  double userTime,
+                  double systemTime)
+{
+    bool found;
+
+    if (tsTaskUsageState == NULL)
+        return;
+
+    LWLockAcquire(tsTaskUsageState->lock, LW_EXCLUSIVE);
+
+    TSTaskUsageSlot *item =
+        hash_search(tsTaskUsage, &taskId, HASH_FIND, NULL);
+    TSTaskUsage *usage;
+
+    if (item != NULL)
+        usage = &tsTaskUsageState->entries[item->slot];
+    else
+    {
+        // сначала запись в хеш-таблице: если места нет, слот старой
+        // задачи остается нетронутым
+        item = hash_search(tsTaskUsage, &taskId, HASH_ENTER_NULL, &found);
+        if (item == NULL)
+        {
+            LWLockRelease(tsTaskUsageState->lock);
+            return;
+        }
+
+        int slot = GetTaskUsageSlot();
+        item->slot = slot;
+
+        usage = &tsTaskUsageState->entries[slot];
+        memset(usage, 0, sizeof(TSTaskUsage));
+        usage->task_id = taskId;
+    }
+
+    if (usage->usage_count < TS_TASK_USAGE_MAX_COUNT)
+        usage->usage_count++;
+
+    usage->calls++;
+    usage->shared_blks_hit += buffers->shared_blks_hit;
+    usage->shared_blks_read += buffers->shared_blks_read;
+    usage->shared_blks_dirtied += buffers->shared_blks_dirtied;
+    usage->shared_blks_written += buffers->shared_blks_written;
+    usage->wal_records += wal->wal_records;
+    usage->wal_fpi += wal->wal_fpi;
+    usage->wal_bytes += wal->wal_bytes;
+    usage->user_time += userTime;
+    usage->system_time += systemTime;
+
+    LWLockRelease(tsTaskUsageState->lock);
+}
+
+
+/*
+ * ts_task_usage - ресурсы, потраченные на выполнения задач
+ */
+Datum
+ts_task_usage(PG_FUNCTION_ARGS)
+{
+    if (tsTaskUsageState == NULL)
+        elog(ERROR, "pg_tkach_scheduler not found in shared_preload_libraries");
+
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+        !(rsinfo->allowedModes & SFRM_Materialize))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("set-valued function called in context that cannot "
+                        "accept a set")));
+
+    MemoryContext oldcontext =
+        MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+    TupleDesc tupdesc;
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    Tuplestorestate *tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+
+    MemoryContextSwitchTo(oldcontext);
+
+    LWLockAcquire(tsTaskUsageState->lock, LW_SHARED);
+
+    for (int i = 0; i < tsTaskUsageState->num_used; i++)
+    {
+        TSTaskUsage *usage = &tsTaskUsageState->entries[i];
+        Datum values[11];
+        bool nulls[11];
+
+        memset(nulls, 0, sizeof(nulls));
+
+        values[0] = Int64GetDatum(usage->task_id);
+        values[1] = Int64GetDatum(usage->calls);
+        values[2] = Int64GetDatum(usage->shared_blks_hit);
+        values[3] = Int64GetDatum(usage->shared_blks_read);
+        values[4] = Int64GetDatum(usage->shared_blks_dirtied);
+        values[5] = Int64GetDatum(usage->shared_blks_written);
+        values[6] = Int64GetDatum(usage->wal_records);
+        values[7] = Int64GetDatum(usage->wal_fpi);
+        values[8] = Int64GetDatum((int64)usage->wal_bytes);
+        values[9] = Float8GetDatum(usage->user_time);
+        values[10] = Float8GetDatum(usage->system_time);
+
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+
+    LWLockRelease(tsTaskUsageState->lock);
+
+    return (Datum)0;
+}